@@ -0,0 +1,60 @@
+#ifndef SNMP_BULKWALKER_H
+#define SNMP_BULKWALKER_H
+
+#include <list>
+#include <string>
+
+#include "snmp/mux_poller.h"
+#include "snmp/table_walker.h"
+
+namespace snmp {
+
+// Called once per host when its walk is over. Table holds everything collected so far,
+// so it's partial if state is failed. Table can be moved out by the callback.
+using walk_callback = void (*) (const std::string &host, walkstate state, table &data, void *magic);
+
+// Walks tables on many hosts at once. Every host starts with a single GETBULK for all of its
+// columns and goes on with per-column pipelined requests (see table_walker). Number of hosts
+// walked at the same time is limited by max_hosts, results are streamed through callbacks
+// as soon as each host is done. Works with session-based poll methods only.
+class bulk_walker
+{
+   public:
+      bulk_walker(unsigned max_hosts = 64, poll_method method = poll_method::select);
+
+      // One walk per host, repeated addition of the same host throws.
+      void add(const char *host, const char *community, const std::vector<oid_vector> &columns,
+            walk_callback callback, void *magic = nullptr, long version = default_version,
+            unsigned repetitions = default_bulk_maxoids);
+
+      void set_max_hosts(unsigned max_hosts) { poller.set_max_hosts(max_hosts); }
+      void set_method(poll_method method);
+      void set_pacing(unsigned pps, unsigned subnet_hosts, unsigned prefix = 24) {
+         poller.set_pacing(pps, subnet_hosts, prefix); }
+
+      // Walks all added hosts and forgets them.
+      void walk();
+
+   private:
+      struct hostwalk
+      {
+         hostwalk(const char *host_, const std::vector<oid_vector> &columns, unsigned repetitions,
+               walk_callback callback_, void *magic_) :
+            host{host_}, walker{columns, repetitions}, callback{callback_}, magic{magic_} { }
+
+         std::string host;
+         table_walker walker;
+         walk_callback callback;
+         void *magic;
+         bool started {false};
+      };
+
+      mux_poller poller;
+      std::list<hostwalk> walks;
+
+      static int answer(int operation, snmp_session *, int reqid, netsnmp_pdu *pdu, void *magic, void *sessp);
+};
+
+} // NAMESPACE END
+
+#endif
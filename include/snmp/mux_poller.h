@@ -1,9 +1,16 @@
 #ifndef SNMP_MUXPOLLER_H
 #define SNMP_MUXPOLLER_H
 
+#include <deque>
 #include <list>
+#include <memory>
 #include <unordered_map>
+
+#include <netinet/in.h>
+#include <net-snmp/library/large_fd_set.h>
+
 #include "snmp/snmp.h"
+#include "snmp/timer_wheel.h"
 
 namespace snmp {
 
@@ -19,20 +26,86 @@ enum class pollstate {
    finished
 };
 
+enum class poll_method {
+   select,   // Classic select() loop. Can't handle descriptors above FD_SETSIZE.
+   epoll,    // Sessions are registered in epoll once, timeouts are driven by timer wheel.
+   shared    // No net-snmp sessions at all. Requests for every host leave few shared UDP sockets
+             // and answers are matched back by request-id. Callbacks can't send follow-up requests
+             // in this mode, so any answer or timeout finishes the task. Callbacks get a stub session
+             // with peer name, community and version only; returning anything but ok_close is an error.
+};
+
+struct polltask;
+
+// Plain token bucket. Used to limit rate of new requests.
+struct token_bucket
+{
+   using clock = std::chrono::steady_clock;
+
+   double rate {};      // Tokens per second. Zero means no limit.
+   double burst {1};
+   double tokens {1};
+   clock::time_point last {};
+
+   void set_rate(double rate_);
+   bool take(clock::time_point now);
+   clock::duration wait(clock::time_point now);
+
+   private:
+      void refill(clock::time_point now);
+};
+
+// Part of the request which had to be split because it didn't fit into the peer's max message size.
+struct request_part
+{
+   request_part(netsnmp_pdu *request_) : request{request_}, reqid{request_->reqid} { }
+
+   pdu_handle request;
+   pdu_handle response;
+   long reqid;
+   bool sent {false};
+   bool done {false};
+};
+
 // Used for active hosts. Holding current state and active SNMP session.
 struct polldata
 {
-   polldata(void *sessp_ = nullptr) : sessp{sessp_}, state{pollstate::polling} { }
-   ~polldata() { if (nullptr != sessp) snmp_sess_close(sessp); }
+   polldata(void *sessp_ = nullptr, polltask *task_ = nullptr, bool cached_ = false) :
+      sessp{sessp_}, task{task_}, state{pollstate::polling}, cached{cached_} { }
+   ~polldata() { if (nullptr != sessp and !cached) snmp_sess_close(sessp); }
 
    polldata(const polldata &other) = delete;
    polldata & operator =(const polldata &other) = delete;
 
-   polldata(polldata &&other) : sessp{other.sessp}, state{other.state} { other.sessp = nullptr; }
+   polldata(polldata &&other) : sessp{other.sessp}, task{other.task}, state{other.state}, cached{other.cached} {
+      other.sessp = nullptr; }
    polldata & operator =(polldata &&other) = delete;
 
    void *sessp;
+   polltask *task;
    pollstate state;
+   bool cached;      // Session is owned by poller's session cache and must not be closed.
+
+   int fd {-1};
+   timer_wheel<polldata *>::handle timer;
+
+   // Time when the first request was sent and timeout used for it. RTT is sampled from the first
+   // answer only and only if it wasn't retransmitted (Karn's algorithm).
+   std::chrono::steady_clock::time_point sent {};
+   long timeout {};
+
+   // Request-id of the task's request. Zero if request was sent in parts.
+   long reqid {};
+
+   // Parts are kept in the original varbinds order and merged into a single answer for the callback.
+   std::list<request_part> parts;
+   bool failed {false};
+
+   // shared method only.
+   int retries {};
+
+   // Subnet of the peer. Used only when pacing is enabled.
+   uint32_t subnet {};
 };
 
 struct polltask
@@ -50,36 +123,153 @@ struct polltask
    polltask & operator =(polltask &&other) = delete;
 
    std::string community;
+   const char *host {};
    netsnmp_pdu *request;
    callback_wf callback;
-   polldata *pdata {};
+   std::list<polldata>::iterator pdata {};
+   peer_stats *peer {};
 
    void *magic;
    long version;
+
+   // Peer address is resolved once and reused on every round by shared method.
+   bool resolved {false};
+   sockaddr_in addr {};
+
+   // Mixed host hash, assigns task to its time slot (see mux_poller::poll). Mixing keeps slots
+   // independent from sharding, which takes the plain std::hash.
+   uint64_t slotkey {};
 };
 
 using taskdata = std::unordered_map<std::string, polltask>;
 
+// Sessions kept open between rounds. Entries which were not used during the whole round are closed.
+struct cached_session
+{
+   sess_handle sess;
+   bool used {false};
+
+   cached_session(void *sessp) : sess{sessp} { }
+};
+
+using sesscache = std::unordered_map<std::string, cached_session>;
+
 class mux_poller
 {
    public:
-      mux_poller(unsigned max_hosts_ = 512) : max_hosts{max_hosts_} { }
+      mux_poller(unsigned max_hosts_ = 512, poll_method method_ = poll_method::select);
+      ~mux_poller();
+
+      mux_poller(const mux_poller &other) = delete;
+      mux_poller & operator =(const mux_poller &other) = delete;
 
-      void add(const char *host, const char *community, netsnmp_pdu *request,
+      // Returns false if the host already has a task, which is left as it is.
+      bool add(const char *host, const char *community, netsnmp_pdu *request,
             callback_wf callback, void *magic = nullptr, long version = default_version)
       {
-         tasks.emplace(std::piecewise_construct, std::forward_as_tuple(host),
+         auto it = tasks.emplace(std::piecewise_construct, std::forward_as_tuple(host),
                std::forward_as_tuple(community, request, callback, magic, version));
+         if (!it.second) return false;
+
+         it.first->second.host = it.first->first.c_str();
+         it.first->second.peer = &(peers[host]);
+         it.first->second.slotkey = (std::hash<std::string>{}(host) * 0x9e3779b97f4a7c15ull) >> 32;
+         return true;
       }
 
+      // RTT estimation for the host. Estimations are kept even when host's task is erased.
+      // Should be called from the poller's thread only (i.e. from callbacks or between rounds).
+      const peer_stats * stats(const std::string &host) const
+      {
+         std::unordered_map<std::string, peer_stats>::const_iterator it = peers.find(host);
+         return (peers.end() == it) ? nullptr : &(it->second);
+      }
+
+      void set_max_hosts(unsigned max_hosts_) { max_hosts = max_hosts_; }
+      void set_method(poll_method method_) { method = method_; }
+      void set_shared_sockets(unsigned count) { nsockets = (0 == count) ? 1 : count; }
+      void set_session_cache(bool enabled) { keep_sessions = enabled; if (!enabled) cache.clear(); }
+
+      // Limits rate of new requests (per second) and number of active hosts in each subnet
+      // with given prefix length. Zero disables the corresponding limit.
+      void set_pacing(unsigned pps, unsigned subnet_hosts, unsigned prefix = 24);
+
       void clear() { tasks.clear(); }
       void erase(const char *host) { tasks.erase(host); }
-      void poll();
+
+      // Polls only tasks of the given time slot, hosts are spread over nslots by their hash.
+      // Callers which poll slots one by one over the interval get a smooth load instead of bursts.
+      void poll(unsigned slot = 0, unsigned nslots = 1);
 
    private:
+      using taskref = taskdata::value_type *;
+
       unsigned max_hosts;
+      poll_method method;
       taskdata tasks;
       std::list<polldata> sessions;
+      std::unordered_map<std::string, peer_stats> peers;
+
+      // Current round. Tasks are taken from 'ready' first - those were delayed by pacing.
+      taskdata::iterator next_task;
+      std::deque<taskref> ready;
+      unsigned slot {};
+      unsigned nslots {1};
+
+      // Pacing. Tasks for a subnet which already has too many active hosts wait in 'deferred'
+      // until one of the subnet's sessions is finished.
+      token_bucket bucket;
+      unsigned subnet_hosts {};
+      uint32_t subnet_mask {};
+      unsigned ndeferred {};
+      std::unordered_map<uint32_t, unsigned> inflight;
+      std::unordered_map<uint32_t, std::deque<taskref>> deferred;
+
+      // Session cache is used by select and epoll methods only.
+      bool keep_sessions {false};
+      sesscache cache;
+
+      // epoll method only.
+      int epfd {-1};
+      netsnmp_large_fd_set readset;
+
+      // epoll and shared methods.
+      timer_wheel<polldata *> timers;
+
+      // shared method only.
+      unsigned nsockets {1};
+      unsigned next_socket {};
+      std::vector<int> sockets;
+      std::unordered_map<long, polldata *> pending;
+      u_char *pktbuf {};
+      size_t pktbuf_len {};
+      std::unique_ptr<u_char []> recvbuf;
+
+      bool pacing() const { return 0 != bucket.rate or 0 != subnet_hosts; }
+      bool round_over() const { return sessions.empty() and ready.empty() and 0 == ndeferred and tasks.end() == next_task; }
+      int wait_time(std::chrono::steady_clock::duration timeout);
+
+      bool resolve_peer(const std::string &host, polltask &task);
+      void dispatch();
+      polldata & start(const std::string &host, polltask &task);
+      void release(polldata &pdata);
+
+      polldata & open_session(const std::string &host, polltask &task);
+      void * reuse_session(const std::string &host, polltask &task);
+      void expire_cache();
+      void arm_timer(polldata &pdata);
+
+      void open_sockets();
+      polldata & open_shared(polltask &task);
+      void send_shared(polldata &pdata, bool resend = false);
+      void send_packet(polldata &pdata, netsnmp_pdu *request, long reqid);
+      void read_shared(int sock);
+      void finish_shared(polldata &pdata);
+      void answer_shared(polldata &pdata, int operation, int reqid, netsnmp_pdu *pdu);
+
+      void poll_select();
+      void poll_epoll();
+      void poll_shared();
 };
 
 } // NAMESPACE END
@@ -0,0 +1,59 @@
+#ifndef SNMP_SHARDEDPOLLER_H
+#define SNMP_SHARDEDPOLLER_H
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include "snmp/mux_poller.h"
+
+namespace snmp {
+
+// Splits tasks between several independent mux_pollers by host. Each shard has its own event loop and
+// sessions and is polled by a separate thread, all of them are joined at the end of the round.
+// Callbacks for a host are always called from the thread of its shard, but different hosts are served
+// concurrently, so anything shared between hosts must be protected by caller.
+class sharded_poller
+{
+   public:
+      sharded_poller(unsigned nshards = 1, unsigned max_hosts_ = 512, poll_method method_ = poll_method::select);
+
+      bool add(const char *host, const char *community, netsnmp_pdu *request,
+            callback_wf callback, void *magic = nullptr, long version = default_version) {
+         return shard(host).add(host, community, request, callback, magic, version); }
+
+      // Shards count can only be changed while there are no tasks.
+      void set_shards(unsigned nshards);
+      void set_max_hosts(unsigned max_hosts_);
+      void set_method(poll_method method_);
+      void set_shared_sockets(unsigned count);
+      void set_session_cache(bool enabled);
+
+      // Limits are global, each shard gets its part. Hosts of one subnet are spread over all shards,
+      // so subnet limit is only approximate with several shards.
+      void set_pacing(unsigned pps_, unsigned subnet_hosts_, unsigned prefix_ = 24);
+
+      void clear() { for (auto &it : shards) it->clear(); }
+      void erase(const char *host) { shard(host).erase(host); }
+      void poll(unsigned slot = 0, unsigned nslots = 1);
+
+      // Same rules as for mux_poller: safe from the host's own callback or between rounds.
+      const peer_stats * stats(const std::string &host) { return shard(host).stats(host); }
+
+   private:
+      unsigned max_hosts;
+      poll_method method;
+      unsigned nsockets {1};
+      bool keep_sessions {false};
+      unsigned pps {}, subnet_hosts {}, prefix {24};
+
+      std::vector<std::unique_ptr<mux_poller>> shards;
+
+      mux_poller & shard(const std::string &host) { return *(shards[std::hash<std::string>{}(host) % shards.size()]); }
+      unsigned shard_hosts() const { return std::max(1u, max_hosts / static_cast<unsigned>(shards.size())); }
+      void apply_pacing(mux_poller &shard);
+};
+
+} // NAMESPACE END
+
+#endif
@@ -23,7 +23,9 @@ enum {
    default_version = SNMP_VERSION_2c,
    default_pdu_type = SNMP_MSG_GET,
    default_bulk_repetitions = 0,
-   default_bulk_maxoids = 60
+   default_bulk_maxoids = 60,
+   default_timeout = 1000000,    // Microseconds, same as net-snmp defaults.
+   default_retries = 5
 };
 
 enum class errtype {
@@ -112,7 +114,9 @@ class oid_handle
          for (auto &it : source) { *ptr++ = it; }
       }
 
+      oid_handle() : size_ {} { }
       oid_handle(const oid *source, size_t size) { copy(source, size); }
+      oid_handle(const oid_handle &other) { copy(other.data_.get(), other.size_); }
       oid_handle(oid_handle &&other) { move(other); }
 
       oid_handle & operator =(const oid_handle &other) { copy(other.data_.get(), other.size_); return *this; }
@@ -120,8 +124,17 @@ class oid_handle
 
       operator oid *() { return data_.get(); };
       oid & operator [](unsigned i) { return data_[i]; }
+      const oid * data() const { return data_.get(); }
       size_t size() const { return size_; }
 
+      // Raw comparisons against varbind's name or its OBJECT IDENTIFIER value. No formatting, no allocations.
+      bool equals(const oid *other, size_t othersize) const {
+         return size_ == othersize and 0 == memcmp(data_.get(), other, size_ * sizeof(oid)); }
+      bool matches_name(const netsnmp_variable_list *var) const {
+         return nullptr != var and equals(var->name, var->name_length); }
+      bool matches_value(const netsnmp_variable_list *var) const {
+         return nullptr != var and ASN_OBJECT_ID == var->type and equals(var->val.objid, var->val_len / sizeof(oid)); }
+
    private:
       size_t size_;
       std::unique_ptr<oid []> data_;
@@ -141,6 +154,25 @@ class oid_handle
       }
 };
 
+// Per-host round trip time estimation, same as TCP does it (RFC 6298). Used to pick request timeout
+// and retries budget: slow but healthy hosts get longer timeouts, hosts which keep timing out
+// get fewer retries, so they don't hold polling slots for too long.
+struct peer_stats
+{
+   double srtt {};         // Smoothed RTT, seconds.
+   double rttvar {};       // RTT variation, seconds.
+   unsigned samples {};
+   unsigned failures {};   // Timeouts in a row.
+   unsigned max_varbinds {}; // Largest request which fits into the peer's max message size, zero if not known.
+
+   void sample(double rtt);
+   void failure() { failures++; }
+   void too_big(unsigned varbinds);
+
+   long timeout() const;   // Microseconds, as in snmp_session.
+   int retries() const;
+};
+
 // Basic facilites
 
 using callback_f = int (*) (int, struct snmp_session *, int, struct snmp_pdu *, void *);
@@ -150,7 +182,8 @@ void * init_snmp_session(const char *host, const char *community, long version =
 netsnmp_pdu * synch_request(void *sessp, netsnmp_pdu *request);
 netsnmp_pdu * synch_request(void *sessp, const oid *reqoid, size_t oidsize, int type = default_pdu_type,
                             int rep = default_bulk_repetitions, int max = default_bulk_maxoids);
-void async_send(void *sessp, netsnmp_pdu *request);
+int async_send(void *sessp, netsnmp_pdu *request);
+void set_timing(void *sessp, const peer_stats &stats);
 
 std::string print_objid(netsnmp_variable_list *var);
 
@@ -159,6 +192,7 @@ std::string print_objid(netsnmp_variable_list *var);
 std::string print_oid(const oid *oid, size_t oidsize);
 std::string print_objid(netsnmp_variable_list *var);
 std::string get_host_objid(void *sessp);
+std::string get_host_objid(void *sessp, oid_handle &raw);
 
 std::vector<unsigned> get_nodes_bytype(void *sessp, const oid *oidst, size_t oidsize, const std::vector<unsigned> &match);
 
@@ -180,6 +214,9 @@ struct int_info_st
 using intinfo = std::vector<int_info_st>;
 intinfo get_intinfo(void *sessp, const intdata &ints);
 
+// Physical interfaces with all their data, walked as a single table.
+intinfo get_intinfo(void *sessp);
+
 } // SNMP NAMESPACE
 
 #endif
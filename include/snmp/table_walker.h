@@ -0,0 +1,107 @@
+#ifndef SNMP_TABLEWALKER_H
+#define SNMP_TABLEWALKER_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "snmp/snmp.h"
+
+namespace snmp {
+
+using oid_vector = std::vector<oid>;
+
+// Single value of a table. Integer types (including Counter64) are stored in 'integer',
+// everything else is kept as raw bytes in 'string'.
+struct cell
+{
+   u_char type {};
+   unsigned long long integer {};
+   std::string string;
+};
+
+// Column values keyed by row index (first sub-identifier after the column OID).
+using column = std::map<unsigned, cell>;
+
+// Columns in the same order as they were requested.
+using table = std::vector<column>;
+
+enum class walkstate {
+   walking,
+   done,
+   failed
+};
+
+// Walks several table columns at once. Every column has its own GETBULK in flight, next request
+// for a column is sent as soon as the previous answer arrives, so the whole table takes about
+// (rows / repetitions) round trips no matter how many columns are walked.
+// Answers are fed with process() from the session's or request's callback. Walker doesn't own
+// the session, and it must outlive all of its outstanding requests - see finished().
+class table_walker
+{
+   public:
+      table_walker(const std::vector<oid_vector> &columns, unsigned repetitions_ = default_bulk_maxoids);
+
+      table_walker(const table_walker &other) = delete;
+      table_walker & operator =(const table_walker &other) = delete;
+
+      // Sends the first request for every column. With nullptr callback answers go to
+      // the session's own callback.
+      void start(void *sessp_, netsnmp_callback callback_ = nullptr, void *magic_ = nullptr);
+
+      // Handles answer to one of walker's requests and sends the next one for the same column.
+      // Answers to unknown requests are ignored.
+      walkstate process(int operation, int reqid, netsnmp_pdu *response);
+
+      // Alternative start: single GETBULK for all columns, sent by someone else (e.g. as mux_poller's
+      // task request). Its answer is passed to process_first(), which continues the walk over sessp
+      // with requests going to the session's own callback.
+      netsnmp_pdu * first_request() const;
+      walkstate process_first(int operation, netsnmp_pdu *response, void *sessp_);
+
+      walkstate state() const { return state_; }
+      bool finished() const { return 0 == outstanding and walkstate::walking != state_; }
+      bool owns(int reqid) const;
+
+      errtype error_type() const { return error_type_; }
+      const char * error() const { return error_.c_str(); }
+      table & result() { return data; }
+
+   private:
+      struct column_state
+      {
+         oid_vector root;
+         oid_vector next;
+         int reqid {};
+         bool done {false};
+      };
+
+      std::vector<column_state> cols;
+      table data;
+      unsigned repetitions;
+      unsigned outstanding {};
+      walkstate state_ {walkstate::walking};
+      errtype error_type_ {errtype::timeout};
+      std::string error_;
+
+      void *sessp {};
+      netsnmp_callback callback {};
+      void *magic {};
+
+      void send(column_state &col);
+      bool check(int operation, netsnmp_pdu *response);
+      bool store(column_state &col, netsnmp_variable_list *var);
+      walkstate proceed();
+      void fail(errtype type, const char *message);
+};
+
+// Synchronous walk over the session. Requests are still pipelined, only the caller is blocked.
+table walk_table(void *sessp, const std::vector<oid_vector> &columns, unsigned repetitions = default_bulk_maxoids);
+
+// Interface table as walked by get_intinfo(sessp). For callers which walk many hosts at once (bulk_walker).
+const std::vector<oid_vector> & intinfo_columns();
+intinfo intinfo_from_table(const table &data);
+
+} // NAMESPACE END
+
+#endif
@@ -0,0 +1,121 @@
+#ifndef SNMP_TIMERWHEEL_H
+#define SNMP_TIMERWHEEL_H
+
+#include <chrono>
+#include <list>
+#include <vector>
+
+namespace snmp {
+
+// Hashed timing wheel. Each slot covers a single tick, so scheduling and cancelling are O(1).
+// Entries which are more than one turn away just stay in their slot until the deadline is reached.
+// Expiration precision is one tick, which is more than enough for SNMP timeouts.
+template <typename T>
+class timer_wheel
+{
+   public:
+      using clock = std::chrono::steady_clock;
+      struct handle;
+
+      struct entry
+      {
+         clock::time_point deadline;
+         T value;
+         handle *owner;
+      };
+
+      using slot = std::list<entry>;
+
+      // Stored by the owner of a timer. Allows to cancel or re-schedule it without any lookups.
+      struct handle
+      {
+         bool armed {false};
+         unsigned slotnum {};
+         typename slot::iterator pos;
+      };
+
+      timer_wheel(clock::duration tick_ = std::chrono::milliseconds(10), unsigned size = 512) :
+         tick{tick_}, slots(size), current{clock::now()} { }
+
+      timer_wheel(const timer_wheel &other) = delete;
+      timer_wheel & operator =(const timer_wheel &other) = delete;
+
+      bool empty() const { return 0 == count; }
+      size_t size() const { return count; }
+
+      void schedule(handle &h, clock::time_point deadline, const T &value)
+      {
+         cancel(h);
+         if (empty()) current = clock::now();
+
+         unsigned long ticks = (deadline > current) ? (deadline - current) / tick : 0;
+         h.slotnum = (cursor + ticks) % slots.size();
+         h.pos = slots[h.slotnum].insert(slots[h.slotnum].end(), entry {deadline, value, &h});
+         h.armed = true;
+         count++;
+      }
+
+      void cancel(handle &h)
+      {
+         if (!h.armed) return;
+         slots[h.slotnum].erase(h.pos);
+         h.armed = false;
+         count--;
+      }
+
+      // Time left until the tick at which the earliest entry expires. Caller should wake up not later than that.
+      // Empty slots are skipped, so an idle wheel doesn't wake the caller every tick. Only one turn is looked
+      // through; if every entry is further than that, the caller wakes up once per turn.
+      clock::duration next_timeout(clock::time_point now) const
+      {
+         clock::time_point next = current + tick * slots.size();
+
+         for (unsigned i = 0; i < slots.size(); i++)
+         {
+            const slot &sl = slots[(cursor + i) % slots.size()];
+            clock::time_point end = current + tick * (i + 1);
+            bool due = false;
+
+            for (auto &e : sl) if (e.deadline < end) { due = true; break; }
+            if (due) { next = end; break; }
+         }
+
+         return (next > now) ? next - now : clock::duration::zero();
+      }
+
+      // Moves wheel up to 'now' and calls func(value) for every expired entry.
+      // Handles are disarmed before the call, so func is free to re-schedule them.
+      template <typename F>
+      void expire(clock::time_point now, F func)
+      {
+         std::vector<T> expired;
+
+         for (; current + tick <= now; current += tick, cursor = (cursor + 1) % slots.size())
+         {
+            if (empty()) { current = now; break; }
+            slot &sl = slots[cursor];
+
+            for (typename slot::iterator it = sl.begin(); it != sl.end();)
+            {
+               if (it->deadline >= current + tick) { ++it; continue; }
+               it->owner->armed = false;
+               expired.push_back(it->value);
+               it = sl.erase(it);
+               count--;
+            }
+         }
+
+         for (auto &value : expired) func(value);
+      }
+
+   private:
+      clock::duration tick;
+      std::vector<slot> slots;
+      unsigned cursor {};
+      size_t count {};
+      clock::time_point current;
+};
+
+} // NAMESPACE END
+
+#endif
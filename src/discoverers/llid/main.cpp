@@ -14,8 +14,7 @@ void escape_string(std::string &source)
 buffer get_hostdata(const char *host, const char *community)
 {
    snmp::sess_handle sessp {snmp::init_snmp_session(host, community)};
-   snmp::intdata ints {snmp::get_host_physints(sessp)};
-   snmp::intinfo info {snmp::get_intinfo(sessp, ints)};
+   snmp::intinfo info {snmp::get_intinfo(sessp)};
 
    buffer json;
    json.print("{\"data\":[");
@@ -0,0 +1,62 @@
+#include "snmp/bulk_walker.h"
+
+namespace snmp {
+
+bulk_walker::bulk_walker(unsigned max_hosts, poll_method method) :
+   poller{max_hosts}
+{
+   set_method(method);
+}
+
+void bulk_walker::set_method(poll_method method)
+{
+   static const char *funcname {"snmp::bulk_walker::set_method"};
+
+   if (poll_method::shared == method)
+      throw snmprun_error {errtype::invalid_input, funcname, "shared method can't send follow-up requests"};
+   poller.set_method(method);
+}
+
+void bulk_walker::add(const char *host, const char *community, const std::vector<oid_vector> &columns,
+      walk_callback callback, void *magic, long version, unsigned repetitions)
+{
+   static const char *funcname {"snmp::bulk_walker::add"};
+   walks.emplace_back(host, columns, repetitions, callback, magic);
+
+   // Walk which isn't polled would never get its callback called.
+   pdu_handle request {walks.back().walker.first_request()};
+   if (!poller.add(host, community, request, answer, static_cast<void *>(&(walks.back())), version))
+   {
+      walks.pop_back();
+      throw snmprun_error {errtype::invalid_input, funcname, "%s: host is already added", host};
+   }
+}
+
+void bulk_walker::walk()
+{
+   try { poller.poll(); }
+   catch (...) { poller.clear(); walks.clear(); throw; }
+
+   poller.clear();
+   walks.clear();
+}
+
+// Session is kept open until all outstanding requests of the host are answered or timed out.
+int bulk_walker::answer(int operation, snmp_session *, int reqid, netsnmp_pdu *pdu, void *magic, void *sessp)
+{
+   hostwalk &hw = *static_cast<hostwalk *>(magic);
+
+   if (hw.started) hw.walker.process(operation, reqid, pdu);
+   else
+   {
+      hw.started = true;
+      hw.walker.process_first(operation, pdu, sessp);
+   }
+
+   if (!hw.walker.finished()) return ok;
+
+   hw.callback(hw.host, hw.walker.state(), hw.walker.result(), hw.magic);
+   return ok_close;
+}
+
+} // NAMESPACE END
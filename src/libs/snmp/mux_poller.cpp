@@ -1,72 +1,785 @@
+#include <algorithm>
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
 #include "snmp/mux_poller.h"
 
 namespace snmp {
 
+using std::chrono::steady_clock;
+
 polltask::polltask(polltask &&other)
 {
    std::swap(community, other.community);
 
+   host = other.host;
    request = other.request;
    callback = other.callback;
    pdata = other.pdata;
+   peer = other.peer;
    magic = other.magic;
    version = other.version;
+   resolved = other.resolved;
+   addr = other.addr;
+   slotkey = other.slotkey;
    other.request = nullptr;
 }
 
+// Session-like description of the task's peer for packet building and for callbacks without a real session.
+// It points into the task, so it must not outlive it.
+void stub_session(const polltask &task, snmp_session &sess)
+{
+   snmp_sess_init(&sess);
+   sess.peername = const_cast<char *>(task.host);
+   sess.version = task.version;
+   sess.community = reinterpret_cast<u_char *>(const_cast<char *>(task.community.c_str()));
+   sess.community_len = task.community.size();
+}
+
+void sample_rtt(polldata &pdata, int operation)
+{
+   if (steady_clock::time_point {} == pdata.sent) return;
+
+   if (NETSNMP_CALLBACK_OP_RECEIVED_MESSAGE != operation) pdata.task->peer->failure();
+   else
+   {
+      std::chrono::duration<double> rtt {steady_clock::now() - pdata.sent};
+      if (rtt.count() * 1000000 < pdata.timeout) pdata.task->peer->sample(rtt.count());
+   }
+
+   pdata.sent = steady_clock::time_point {};
+}
+
+unsigned count_varbinds(netsnmp_pdu *pdu)
+{
+   unsigned count {};
+   for (netsnmp_variable_list *vars = pdu->variables; nullptr != vars; vars = vars->next_variable) count++;
+   return count;
+}
+
+// Splitting GETBULK would change its meaning. Agents truncate oversized GETBULK answers anyway.
+bool splittable(netsnmp_pdu *request)
+{
+   return SNMP_MSG_GETBULK != request->command and 1 < count_varbinds(request);
+}
+
+bool split_needed(const polltask &task)
+{
+   return 0 != task.peer->max_varbinds and SNMP_MSG_GETBULK != task.request->command and
+      task.peer->max_varbinds < count_varbinds(task.request);
+}
+
+// Splits request into parts of at most max_varbinds varbinds and inserts them before 'pos'.
+// Every part gets its own request-id, so they can be in flight at the same time.
+void split_request(polldata &pdata, std::list<request_part>::iterator pos, netsnmp_pdu *request)
+{
+   static const char *funcname {"snmp::split_request"};
+   unsigned total = count_varbinds(request), max = pdata.task->peer->max_varbinds;
+
+   for (unsigned skip = 0; skip < total; skip += max)
+   {
+      netsnmp_pdu *part = snmp_split_pdu(request, skip, max);
+      if (nullptr == part) throw snmplib_error {funcname, "failed to split request"};
+
+      part->reqid = part->msgid = snmp_get_next_reqid();
+      pdata.parts.emplace(pos, part);
+   }
+}
+
+// Answers are joined in the original order. The first error status is kept with index adjusted
+// to the merged varbinds list.
+netsnmp_pdu * merge_parts(polldata &pdata)
+{
+   static const char *funcname {"snmp::merge_parts"};
+
+   netsnmp_pdu *merged {nullptr};
+   netsnmp_variable_list **tail {nullptr};
+   unsigned offset {};
+
+   for (auto &part : pdata.parts)
+   {
+      netsnmp_pdu *response = part.response.pdu;
+
+      if (nullptr == merged) merged = snmp_clone_pdu(response);
+      else
+      {
+         if (0 == merged->errstat and 0 != response->errstat)
+         {
+            merged->errstat = response->errstat;
+            merged->errindex = response->errindex + offset;
+         }
+
+         if (nullptr != response->variables and nullptr == (*tail = snmp_clone_varbind(response->variables)))
+         {
+            snmp_free_pdu(merged);
+            throw snmplib_error {funcname, "failed to clone varbinds"};
+         }
+      }
+
+      if (nullptr == merged) throw snmplib_error {funcname, "failed to clone answer"};
+      for (tail = &(merged->variables); nullptr != *tail; tail = &((*tail)->next_variable));
+      offset += count_varbinds(part.request);
+   }
+
+   merged->reqid = pdata.reqid;
+   return merged;
+}
+
+// Checks the answer against the task's split state. Returns true if answer should be passed to the
+// callback: request wasn't split (or it's a follow-up request sent by the callback itself), or the
+// last part is done and operation and pdu are replaced with the merged result. False means more
+// parts are expected, after tooBig new parts are added and have to be sent by caller.
+bool collect_answer(polldata &pdata, int &operation, long reqid, netsnmp_pdu *&pdu, pdu_handle &merged)
+{
+   polltask &task = *(pdata.task);
+   bool toobig = NETSNMP_CALLBACK_OP_RECEIVED_MESSAGE == operation and SNMP_ERR_TOOBIG == pdu->errstat;
+
+   if (pdata.parts.empty())
+   {
+      if (!toobig or reqid != pdata.reqid or !splittable(task.request)) return true;
+
+      task.peer->too_big(count_varbinds(task.request));
+      pdata.reqid = 0;
+      split_request(pdata, pdata.parts.end(), task.request);
+      return false;
+   }
+
+   std::list<request_part>::iterator it = std::find_if(pdata.parts.begin(), pdata.parts.end(),
+         [reqid](const request_part &part) { return reqid == part.reqid; });
+   if (pdata.parts.end() == it) return true;
+   if (it->done) return false;
+
+   if (toobig and splittable(it->request))
+   {
+      task.peer->too_big(count_varbinds(it->request));
+      split_request(pdata, it, it->request);
+      pdata.parts.erase(it);
+      return false;
+   }
+
+   it->done = true;
+   if (NETSNMP_CALLBACK_OP_RECEIVED_MESSAGE == operation) it->response = snmp_clone_pdu(pdu);
+   else pdata.failed = true;
+
+   for (auto &part : pdata.parts) { if (!part.done) return false; }
+
+   if (pdata.failed) { operation = NETSNMP_CALLBACK_OP_TIMED_OUT; pdu = nullptr; }
+   else { operation = NETSNMP_CALLBACK_OP_RECEIVED_MESSAGE; pdu = merged = merge_parts(pdata); }
+
+   pdata.parts.clear();
+   return true;
+}
+
+void send_parts(polldata &pdata)
+{
+   for (auto &part : pdata.parts)
+   {
+      if (part.sent) continue;
+      async_send(pdata.sessp, snmp_clone_pdu(part.request));
+      part.sent = true;
+   }
+}
+
+// Sends the task's request, split into parts if the peer is known to reject requests that large.
+void send_request(polldata &pdata)
+{
+   polltask &task = *(pdata.task);
+
+   if (!split_needed(task)) pdata.reqid = async_send(pdata.sessp, snmp_clone_pdu(task.request));
+   else
+   {
+      split_request(pdata, pdata.parts.end(), task.request);
+      send_parts(pdata);
+   }
+}
+
 extern "C" int callback_wrap(int operation, snmp_session *sessp, int reqid, netsnmp_pdu *pdu, void *magic)
 {
    polltask *task = static_cast<polltask *>(magic);
-   if (ok_close == task->callback(operation, sessp, reqid, pdu, task->magic, task->pdata->sessp))
-      task->pdata->state = pollstate::finished;
+   polldata &pdata = *(task->pdata);
+   sample_rtt(pdata, operation);
+
+   pdu_handle merged;
+   if (!collect_answer(pdata, operation, reqid, pdu, merged)) { send_parts(pdata); return 1; }
+
+   if (ok_close == task->callback(operation, sessp, reqid, pdu, task->magic, pdata.sessp))
+      pdata.state = pollstate::finished;
    return 1;
 }
 
-void mux_poller::poll()
+mux_poller::mux_poller(unsigned max_hosts_, poll_method method_) :
+   max_hosts{max_hosts_}, method{method_}
 {
-   static const char *funcname {"snmp::mux_poller::poll"};
-   if (0 == tasks.size()) return;
+   netsnmp_large_fd_set_init(&readset, FD_SETSIZE);
+}
 
-   int fds, block;
-   fd_set fdset;
-   timeval timeout;
-   taskdata::iterator it = tasks.begin();
+mux_poller::~mux_poller()
+{
+   sessions.clear();
+   if (-1 != epfd) close(epfd);
+   for (int sock : sockets) close(sock);
+
+   netsnmp_large_fd_set_cleanup(&readset);
+   free(pktbuf);
+}
+
+polldata & mux_poller::open_session(const std::string &host, polltask &task)
+{
+   static const char *funcname {"snmp::mux_poller::open_session"};
+
+   void *sessp = keep_sessions ? reuse_session(host, task) : init_snmp_session(host.c_str(),
+         task.community.c_str(), task.version, callback_wrap, static_cast<void *>(&task));
+
+   sessions.emplace_front(sessp, &task, keep_sessions);
+   task.pdata = sessions.begin();
+   task.pdata->fd = snmp_sess_transport(sessp)->sock;
+
+   polldata &pdata = *(task.pdata);
+   set_timing(sessp, *(task.peer));
+   pdata.timeout = task.peer->timeout();
+   pdata.sent = steady_clock::now();
+
+   try { send_request(pdata); }
+   catch (snmprun_error &error) { 
+      throw snmprun_error {errtype::runtime, funcname, "poll failed: %s", error.what()}; }
+
+   return pdata;
+}
+
+// Session is reused only by exactly the same host, community and version. Name resolution and
+// socket setup happen once. Callback magic is refreshed since task could be re-added since last round.
+void * mux_poller::reuse_session(const std::string &host, polltask &task)
+{
+   std::string key {host};
+   key.append(1, '/').append(task.community).append(1, '/').append(std::to_string(task.version));
 
-   for (unsigned active_hosts;;)
+   sesscache::iterator it = cache.find(key);
+   if (cache.end() == it)
+   {
+      it = cache.emplace(std::piecewise_construct, std::forward_as_tuple(key), std::forward_as_tuple(
+               init_snmp_session(host.c_str(), task.community.c_str(), task.version, callback_wrap, &task))).first;
+   }
+
+   else snmp_sess_session(it->second.sess)->callback_magic = static_cast<void *>(&task);
+   it->second.used = true;
+   return it->second.sess;
+}
+
+void mux_poller::expire_cache()
+{
+   for (sesscache::iterator it = cache.begin(); it != cache.end();)
    {
-      active_hosts = sessions.size();
-      if (active_hosts < max_hosts)
+      if (!it->second.used) { it = cache.erase(it); continue; }
+      it->second.used = false;
+      ++it;
+   }
+}
+
+void token_bucket::set_rate(double rate_)
+{
+   rate = rate_;
+   // Allowing short bursts of about 50ms worth of requests.
+   burst = tokens = std::max(1.0, rate / 20);
+   last = clock::now();
+}
+
+void token_bucket::refill(clock::time_point now)
+{
+   std::chrono::duration<double> elapsed {now - last};
+   tokens = std::min(burst, tokens + elapsed.count() * rate);
+   last = now;
+}
+
+bool token_bucket::take(clock::time_point now)
+{
+   if (0 == rate) return true;
+   refill(now);
+
+   if (1 > tokens) return false;
+   tokens -= 1;
+   return true;
+}
+
+token_bucket::clock::duration token_bucket::wait(clock::time_point now)
+{
+   if (0 == rate) return clock::duration::zero();
+   refill(now);
+
+   if (1 <= tokens) return clock::duration::zero();
+   return std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>((1 - tokens) / rate));
+}
+
+void mux_poller::set_pacing(unsigned pps, unsigned subnet_hosts_, unsigned prefix)
+{
+   bucket.set_rate(pps);
+   subnet_hosts = subnet_hosts_;
+   subnet_mask = (0 == prefix) ? 0 : (0xffffffffu << (32 - std::min(prefix, 32u)));
+}
+
+// Returns false if the host can't be resolved. Failures are not cached, so the host is tried again next round.
+bool mux_poller::resolve_peer(const std::string &host, polltask &task)
+{
+   if (task.resolved) return true;
+
+   addrinfo hints {}, *result;
+   hints.ai_family = AF_INET;
+   hints.ai_socktype = SOCK_DGRAM;
+
+   int retval = getaddrinfo(host.c_str(), "161", &hints, &result);
+   if (0 != retval) return false;
+
+   memcpy(&task.addr, result->ai_addr, sizeof(task.addr));
+   freeaddrinfo(result);
+   return task.resolved = true;
+}
+
+// Starts new requests while there are free slots. With pacing enabled request also has to get a token
+// and its subnet must have a free slot, otherwise the task waits. Task whose host can't be resolved is failed
+// through its callback, so a single bad host doesn't stop the round.
+void mux_poller::dispatch()
+{
+   steady_clock::time_point now {steady_clock::now()};
+   taskref entry;
+   uint32_t subnet {};
+
+   while (sessions.size() < max_hosts)
+   {
+      if (!ready.empty()) { entry = ready.front(); ready.pop_front(); }
+      else if (tasks.end() != next_task)
       {
-         if (0 == active_hosts and it == tasks.end()) return;
-         unsigned delta = max_hosts - active_hosts;
-         void *sessp;
+         entry = &(*next_task++);
+         if (1 != nslots and slot != entry->second.slotkey % nslots) continue;
+      }
+      else return;
 
-         for (unsigned i = 0; it != tasks.end() and i < delta; ++i, ++it)
-         {
-            polltask &task = it->second;
-            sessp = init_snmp_session(it->first.c_str(), task.community.c_str(),
-                  task.version, callback_wrap, static_cast<void *>(&task));
+      if ((pacing() or poll_method::shared == method) and !resolve_peer(entry->first, entry->second))
+      {
+         snmp_session sess;
+         stub_session(entry->second, sess);
+         entry->second.callback(NETSNMP_CALLBACK_OP_SEND_FAILED, &sess, 0, nullptr, entry->second.magic, nullptr);
+         continue;
+      }
 
-            sessions.emplace_front(sessp);
-            task.pdata = &(sessions.front());
+      if (pacing())
+      {
+         subnet = ntohl(entry->second.addr.sin_addr.s_addr) & subnet_mask;
 
-            try { async_send(sessp, snmp_clone_pdu(task.request)); }
-            catch (snmprun_error &error) { 
-               throw snmprun_error {errtype::runtime, funcname, "poll failed: %s", error.what()}; }
+         if (0 != subnet_hosts and subnet_hosts <= inflight[subnet])
+         {
+            deferred[subnet].push_back(entry);
+            ndeferred++;
+            continue;
          }
+
+         if (!bucket.take(now)) { ready.push_front(entry); return; }
       }
 
+      polldata &pdata = start(entry->first, entry->second);
+      if (pacing()) { pdata.subnet = subnet; inflight[subnet]++; }
+   }
+}
+
+// Should be called for every session before it's removed.
+void mux_poller::release(polldata &pdata)
+{
+   if (!pacing()) return;
+   inflight[pdata.subnet]--;
+
+   std::unordered_map<uint32_t, std::deque<taskref>>::iterator it = deferred.find(pdata.subnet);
+   if (deferred.end() == it or it->second.empty()) return;
+
+   ready.push_back(it->second.front());
+   it->second.pop_front();
+   ndeferred--;
+}
+
+// Milliseconds to wait for events. Wait is shortened if there are tasks waiting for a token.
+int mux_poller::wait_time(steady_clock::duration timeout)
+{
+   if (sessions.size() < max_hosts and (!ready.empty() or tasks.end() != next_task))
+      timeout = std::min(timeout, bucket.wait(steady_clock::now()));
+   return std::chrono::duration_cast<std::chrono::milliseconds>(timeout + std::chrono::microseconds(999)).count();
+}
+
+polldata & mux_poller::start(const std::string &host, polltask &task)
+{
+   static const char *funcname {"snmp::mux_poller::start"};
+   if (poll_method::shared == method) return open_shared(task);
+
+   polldata &pdata = open_session(host, task);
+   if (poll_method::select == method)
+   {
+      if (FD_SETSIZE <= pdata.fd)
+         throw snmprun_error {errtype::runtime, funcname, "session descriptor exceeds FD_SETSIZE. "
+            "Lower max hosts value or use epoll method."};
+      return pdata;
+   }
+
+   epoll_event event {};
+   event.events = EPOLLIN;
+   event.data.ptr = &pdata;
+
+   if (-1 == epoll_ctl(epfd, EPOLL_CTL_ADD, pdata.fd, &event))
+      throw snmprun_error {errtype::runtime, funcname, "epoll_ctl() failed: %s", strerror(errno)};
+   arm_timer(pdata);
+   return pdata;
+}
+
+void mux_poller::poll(unsigned slot_, unsigned nslots_)
+{
+   if (0 == tasks.size()) return;
+
+   slot = slot_;
+   nslots = (0 == nslots_) ? 1 : nslots_;
+   next_task = tasks.begin();
+   ready.clear();
+   inflight.clear();
+   deferred.clear();
+   ndeferred = 0;
+
+   switch (method)
+   {
+      case poll_method::select: poll_select(); break;
+      case poll_method::epoll:  poll_epoll();  break;
+      case poll_method::shared: poll_shared(); break;
+   }
+
+   // Every slot uses only its own hosts' sessions, so unused ones are looked for once the whole round is over.
+   if (keep_sessions and nslots - 1 == slot) expire_cache();
+}
+
+void mux_poller::poll_select()
+{
+   static const char *funcname {"snmp::mux_poller::poll_select"};
+
+   int fds, block;
+   fd_set fdset;
+   timeval timeout;
+   std::chrono::microseconds wait;
+
+   for (;;)
+   {
+      dispatch();
+      if (round_over()) return;
+
       fds = block = 0;
       FD_ZERO(&fdset);
-      
+      timeout = timeval {1, 0};
+
       for (auto &sess : sessions) snmp_sess_select_info(sess.sessp, &fds, &fdset, &timeout, &block);
+      wait = std::chrono::milliseconds(wait_time(std::chrono::seconds(timeout.tv_sec) + std::chrono::microseconds(timeout.tv_usec)));
+      timeout.tv_sec = wait.count() / 1000000;
+      timeout.tv_usec = wait.count() % 1000000;
+
       if (0 > (fds = select(fds, &fdset, nullptr, nullptr, &timeout)))
          throw snmprun_error {errtype::runtime, funcname, "select() failed: %s", strerror(errno)};
 
       if (fds) { for (auto &sess : sessions) snmp_sess_read(sess.sessp, &fdset); }
       else     { for (auto &sess : sessions) snmp_sess_timeout(sess.sessp);      }
 
-      sessions.remove_if([](const polldata &p) { return (pollstate::finished == p.state); });
+      sessions.remove_if([this](polldata &p)
+      {
+         if (pollstate::finished != p.state) return false;
+         release(p);
+         return true;
+      });
+   }
+}
+
+// Asks net-snmp when the session's outstanding request should be retried or timed out.
+void mux_poller::arm_timer(polldata &pdata)
+{
+   int fds {}, block {1};
+   timeval timeout {};
+
+   snmp_sess_select_info2(pdata.sessp, &fds, &readset, &timeout, &block);
+   NETSNMP_LARGE_FD_CLR(pdata.fd, &readset);
+
+   if (block) { timers.cancel(pdata.timer); return; }
+   timers.schedule(pdata.timer, steady_clock::now() + std::chrono::seconds(timeout.tv_sec) +
+         std::chrono::microseconds(timeout.tv_usec), &pdata);
+}
+
+void mux_poller::poll_epoll()
+{
+   static const char *funcname {"snmp::mux_poller::poll_epoll"};
+   static const steady_clock::duration default_wait {std::chrono::seconds(1)};
+
+   if (-1 == epfd and -1 == (epfd = epoll_create1(EPOLL_CLOEXEC)))
+      throw snmprun_error {errtype::runtime, funcname, "epoll_create1() failed: %s", strerror(errno)};
+
+   int nfds;
+   std::vector<epoll_event> events (std::min(max_hosts, 1024u));
+   std::vector<polldata *> done;
+
+   // Session is either still waiting for an answer and needs a new deadline, or it's ready to be closed.
+   auto process = [this, &done](polldata *pdata)
+   {
+      if (pollstate::finished != pdata->state) { arm_timer(*pdata); return; }
+      timers.cancel(pdata->timer);
+      done.push_back(pdata);
+   };
+
+   for (;;)
+   {
+      dispatch();
+      if (round_over()) return;
+
+      nfds = epoll_wait(epfd, events.data(), events.size(),
+            wait_time(timers.empty() ? default_wait : timers.next_timeout(steady_clock::now())));
+
+      if (0 > nfds)
+      {
+         if (EINTR == errno) continue;
+         throw snmprun_error {errtype::runtime, funcname, "epoll_wait() failed: %s", strerror(errno)};
+      }
+
+      for (int i = 0; i < nfds; i++)
+      {
+         polldata *pdata = static_cast<polldata *>(events[i].data.ptr);
+         NETSNMP_LARGE_FD_SET(pdata->fd, &readset);
+         snmp_sess_read2(pdata->sessp, &readset);
+         NETSNMP_LARGE_FD_CLR(pdata->fd, &readset);
+         process(pdata);
+      }
+
+      timers.expire(steady_clock::now(), [&process](polldata *pdata)
+      {
+         snmp_sess_timeout(pdata->sessp);
+         process(pdata);
+      });
+
+      for (auto pdata : done)
+      {
+         epoll_ctl(epfd, EPOLL_CTL_DEL, pdata->fd, nullptr);
+         release(*pdata);
+         sessions.erase(pdata->task->pdata);
+      }
+      done.clear();
+   }
+}
+
+void mux_poller::open_sockets()
+{
+   static const char *funcname {"snmp::mux_poller::open_sockets"};
+   // Bursts of answers from thousands of hosts will arrive on the same socket.
+   static const int rcvbuf_size {4 * 1024 * 1024};
+
+   for (int sock; sockets.size() < nsockets;)
+   {
+      if (-1 == (sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)))
+         throw snmprun_error {errtype::runtime, funcname, "socket() failed: %s", strerror(errno)};
+
+      setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf_size, sizeof(rcvbuf_size));
+      sockets.push_back(sock);
+   }
+
+   if (!recvbuf) recvbuf.reset(new u_char[SNMP_MAX_PACKET_LEN]);
+   if (nullptr == pktbuf)
+   {
+      pktbuf_len = 2048;
+      if (nullptr == (pktbuf = static_cast<u_char *>(malloc(pktbuf_len))))
+         throw snmprun_error {errtype::runtime, funcname, "failed to allocate packet buffer"};
+   }
+}
+
+// Peer address is already resolved by dispatch().
+polldata & mux_poller::open_shared(polltask &task)
+{
+   sessions.emplace_front(nullptr, &task);
+   task.pdata = sessions.begin();
+
+   polldata &pdata = *(task.pdata);
+   pdata.fd = sockets[next_socket++ % sockets.size()];
+
+   if (split_needed(task)) split_request(pdata, pdata.parts.end(), task.request);
+   else pending[pdata.reqid = snmp_get_next_reqid()] = &pdata;
+   for (auto &part : pdata.parts) pending[part.reqid] = &pdata;
+
+   send_shared(pdata);
+   return pdata;
+}
+
+// Sends whole request or its parts which weren't sent yet (all unanswered parts on resend).
+void mux_poller::send_shared(polldata &pdata, bool resend)
+{
+   polltask &task = *(pdata.task);
+
+   if (0 == pdata.retries)
+   {
+      pdata.timeout = task.peer->timeout();
+      pdata.sent = steady_clock::now();
+   }
+
+   if (pdata.parts.empty()) send_packet(pdata, task.request, pdata.reqid);
+   for (auto &part : pdata.parts)
+   {
+      if (part.done or (part.sent and !resend)) continue;
+      send_packet(pdata, part.request, part.reqid);
+      part.sent = true;
+   }
+
+   timers.schedule(pdata.timer, steady_clock::now() + std::chrono::microseconds(pdata.timeout), &pdata);
+}
+
+// Builds packet the same way net-snmp does it for its own sessions and sends it to the task's peer.
+// Send errors are not fatal - lost request will be retried by timer.
+void mux_poller::send_packet(polldata &pdata, netsnmp_pdu *pdu, long reqid)
+{
+   static const char *funcname {"snmp::mux_poller::send_packet"};
+   polltask &task = *(pdata.task);
+
+   snmp_session sess;
+   stub_session(task, sess);
+
+   pdu_handle request {snmp_clone_pdu(pdu)};
+   request.pdu->reqid = reqid;
+
+   u_char *packet;
+   size_t length, offset {};
+
+   if (netsnmp_ds_get_boolean(NETSNMP_DS_LIBRARY_ID, NETSNMP_DS_LIB_REVERSE_ENCODE))
+   {
+      if (0 != snmp_build(&pktbuf, &pktbuf_len, &offset, &sess, request))
+         throw snmprun_error {errtype::invalid_input, funcname, "failed to build request packet"};
+      packet = pktbuf + pktbuf_len - offset;
+      length = offset;
+   }
+
+   else
+   {
+      length = pktbuf_len;
+      if (0 != snmp_build(&pktbuf, &length, &offset, &sess, request))
+         throw snmprun_error {errtype::invalid_input, funcname, "failed to build request packet"};
+      packet = pktbuf;
+      length = pktbuf_len - length;
+   }
+
+   sendto(pdata.fd, packet, length, 0, reinterpret_cast<sockaddr *>(&task.addr), sizeof(task.addr));
+}
+
+void mux_poller::finish_shared(polldata &pdata)
+{
+   timers.cancel(pdata.timer);
+   pending.erase(pdata.reqid);
+   for (auto &part : pdata.parts) pending.erase(part.reqid);
+   release(pdata);
+   sessions.erase(pdata.task->pdata);
+}
+
+// Task is finished whatever callback returns, since there is no session to send follow-up requests from.
+void mux_poller::answer_shared(polldata &pdata, int operation, int reqid, netsnmp_pdu *pdu)
+{
+   static const char *funcname {"snmp::mux_poller::answer_shared"};
+   polltask &task = *(pdata.task);
+
+   snmp_session sess;
+   stub_session(task, sess);
+
+   int retval = task.callback(operation, &sess, reqid, pdu, task.magic, nullptr);
+   finish_shared(pdata);
+
+   if (ok_close != retval)
+      throw snmprun_error {errtype::invalid_input, funcname, "%s: callback expects follow-up requests, "
+         "which can't be sent by shared method", task.host};
+}
+
+void mux_poller::read_shared(int sock)
+{
+   static const char *funcname {"snmp::mux_poller::read_shared"};
+
+   snmp_session sess;
+   snmp_sess_init(&sess);
+
+   sockaddr_in from;
+   socklen_t fromlen;
+   ssize_t len;
+   std::unordered_map<long, polldata *>::iterator it;
+
+   for (;;)
+   {
+      fromlen = sizeof(from);
+      if (0 > (len = recvfrom(sock, recvbuf.get(), SNMP_MAX_PACKET_LEN, 0, reinterpret_cast<sockaddr *>(&from), &fromlen)))
+      {
+         if (EAGAIN == errno or EWOULDBLOCK == errno) return;
+         if (EINTR == errno) continue;
+         throw snmprun_error {errtype::runtime, funcname, "recvfrom() failed: %s", strerror(errno)};
+      }
+
+      // Garbage, late answers for already finished tasks and answers from unexpected peers are dropped.
+      pdu_handle response {static_cast<netsnmp_pdu *>(calloc(1, sizeof(netsnmp_pdu)))};
+      if (0 != snmp_parse(nullptr, &sess, response, recvbuf.get(), len)) continue;
+      if (SNMP_MSG_RESPONSE != response.pdu->command) continue;
+      if (pending.end() == (it = pending.find(response.pdu->reqid))) continue;
+
+      polldata &pdata = *(it->second);
+      polltask &task = *(pdata.task);
+      if (from.sin_addr.s_addr != task.addr.sin_addr.s_addr or from.sin_port != task.addr.sin_port) continue;
+
+      if (0 != pdata.retries) pdata.sent = steady_clock::time_point {};
+      sample_rtt(pdata, NETSNMP_CALLBACK_OP_RECEIVED_MESSAGE);
+
+      int operation {NETSNMP_CALLBACK_OP_RECEIVED_MESSAGE};
+      netsnmp_pdu *answer {response};
+      pdu_handle merged;
+
+      if (!collect_answer(pdata, operation, response.pdu->reqid, answer, merged))
+      {
+         pending.erase(response.pdu->reqid);
+         for (auto &part : pdata.parts) { if (!part.sent) pending[part.reqid] = &pdata; }
+         send_shared(pdata);
+         continue;
+      }
+
+      answer_shared(pdata, operation, response.pdu->reqid, answer);
+   }
+}
+
+void mux_poller::poll_shared()
+{
+   static const char *funcname {"snmp::mux_poller::poll_shared"};
+   static const steady_clock::duration default_wait {std::chrono::seconds(1)};
+
+   open_sockets();
+
+   int nfds;
+   std::vector<pollfd> fds (sockets.size());
+   for (unsigned i = 0; i < sockets.size(); i++) fds[i] = pollfd {sockets[i], POLLIN, 0};
+
+   std::vector<polldata *> done;
+
+   for (;;)
+   {
+      dispatch();
+      if (round_over()) return;
+
+      if (0 > (nfds = ::poll(fds.data(), fds.size(),
+            wait_time(timers.empty() ? default_wait : timers.next_timeout(steady_clock::now())))))
+      {
+         if (EINTR == errno) continue;
+         throw snmprun_error {errtype::runtime, funcname, "poll() failed: %s", strerror(errno)};
+      }
+
+      for (unsigned i = 0; 0 < nfds and i < fds.size(); i++)
+         if (fds[i].revents & POLLIN) read_shared(fds[i].fd);
+
+      timers.expire(steady_clock::now(), [this, &done](polldata *pdata)
+      {
+         if (pdata->task->peer->retries() > pdata->retries++) { send_shared(*pdata, true); return; }
+         done.push_back(pdata);
+      });
+
+      for (auto pdata : done)
+      {
+         sample_rtt(*pdata, NETSNMP_CALLBACK_OP_TIMED_OUT);
+         answer_shared(*pdata, NETSNMP_CALLBACK_OP_TIMED_OUT, pdata->reqid, nullptr);
+      }
+      done.clear();
    }
 }
 
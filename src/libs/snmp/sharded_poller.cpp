@@ -0,0 +1,91 @@
+#include <algorithm>
+#include <exception>
+#include <thread>
+
+#include "snmp/sharded_poller.h"
+
+namespace snmp {
+
+sharded_poller::sharded_poller(unsigned nshards, unsigned max_hosts_, poll_method method_) :
+   max_hosts{max_hosts_}, method{method_}
+{
+   set_shards(nshards);
+}
+
+void sharded_poller::set_shards(unsigned nshards)
+{
+   shards.clear();
+   if (0 == nshards) nshards = 1;
+
+   for (unsigned i = 0; i < nshards; i++)
+   {
+      shards.emplace_back(new mux_poller {max_hosts, method});
+      shards.back()->set_shared_sockets(nsockets);
+      shards.back()->set_session_cache(keep_sessions);
+   }
+
+   for (auto &it : shards) apply_pacing(*it);
+
+   // Total amount of active hosts is split evenly between shards.
+   for (auto &it : shards) it->set_max_hosts(shard_hosts());
+}
+
+void sharded_poller::set_max_hosts(unsigned max_hosts_)
+{
+   max_hosts = max_hosts_;
+   for (auto &it : shards) it->set_max_hosts(shard_hosts());
+}
+
+void sharded_poller::set_method(poll_method method_)
+{
+   method = method_;
+   for (auto &it : shards) it->set_method(method);
+}
+
+void sharded_poller::set_shared_sockets(unsigned count)
+{
+   nsockets = count;
+   for (auto &it : shards) it->set_shared_sockets(count);
+}
+
+void sharded_poller::set_session_cache(bool enabled)
+{
+   keep_sessions = enabled;
+   for (auto &it : shards) it->set_session_cache(enabled);
+}
+
+void sharded_poller::set_pacing(unsigned pps_, unsigned subnet_hosts_, unsigned prefix_)
+{
+   pps = pps_;
+   subnet_hosts = subnet_hosts_;
+   prefix = prefix_;
+   for (auto &it : shards) apply_pacing(*it);
+}
+
+void sharded_poller::apply_pacing(mux_poller &shard)
+{
+   unsigned n = shards.size();
+   shard.set_pacing((0 == pps) ? 0 : std::max(1u, pps / n), (0 == subnet_hosts) ? 0 : std::max(1u, subnet_hosts / n), prefix);
+}
+
+void sharded_poller::poll(unsigned slot, unsigned nslots)
+{
+   if (1 == shards.size()) { shards.front()->poll(slot, nslots); return; }
+
+   std::vector<std::thread> threads;
+   std::vector<std::exception_ptr> errors (shards.size());
+
+   for (unsigned i = 0; i < shards.size(); i++)
+   {
+      threads.emplace_back([this, i, slot, nslots, &errors]()
+      {
+         try { shards[i]->poll(slot, nslots); }
+         catch (...) { errors[i] = std::current_exception(); }
+      });
+   }
+
+   for (auto &it : threads) it.join();
+   for (auto &it : errors) { if (it) std::rethrow_exception(it); }
+}
+
+} // NAMESPACE END
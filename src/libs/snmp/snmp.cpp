@@ -1,5 +1,9 @@
+#include <algorithm>
+#include <cmath>
+
 #include "snmp/snmp.h"
 #include "snmp/oids.h"
+#include "snmp/table_walker.h"
 
 namespace snmp {
 
@@ -20,6 +24,42 @@ snmplib_error::snmplib_error(const char *funcname, const char *format, ...) noex
    va_end(args);
 }
 
+void peer_stats::sample(double rtt)
+{
+   if (0 == samples) { srtt = rtt; rttvar = rtt / 2; }
+   else
+   {
+      rttvar = 0.75 * rttvar + 0.25 * std::fabs(srtt - rtt);
+      srtt = 0.875 * srtt + 0.125 * rtt;
+   }
+
+   samples++;
+   failures = 0;
+}
+
+// Request with given amount of varbinds was answered with tooBig. Limit is only lowered, so it settles
+// on a value which is known to work.
+void peer_stats::too_big(unsigned varbinds)
+{
+   unsigned limit = std::max(1u, varbinds / 2);
+   if (0 == max_varbinds or limit < max_varbinds) max_varbinds = limit;
+}
+
+long peer_stats::timeout() const
+{
+   static const long min_timeout {100000};
+   static const long max_timeout {5 * default_timeout};
+
+   if (0 == samples) return default_timeout;
+   long rto = (srtt + std::max(0.01, 4 * rttvar)) * 1000000;
+   return std::min(max_timeout, std::max(min_timeout, rto));
+}
+
+int peer_stats::retries() const
+{
+   return std::max(0, default_retries - 2 * static_cast<int>(failures));
+}
+
 void * init_snmp_session(const char *host, const char *community, long version, callback_f callback, void *magic)
 {
    static const char *funcname {"snmp::init_snmp_session"};
@@ -94,13 +134,15 @@ netsnmp_pdu * synch_request(void *sessp, const oid *reqoid, size_t oidsize, int
    return synch_request(sessp, request);
 }
 
-void async_send(void *sessp, netsnmp_pdu *request)
+// Returns request-id of the sent request.
+int async_send(void *sessp, netsnmp_pdu *request)
 {
    static const char *funcname {"snmp::async_send"};
    if (nullptr == sessp) throw snmprun_error {errtype::invalid_input, funcname, "session nullptr"};
    if (nullptr == request) throw snmprun_error {errtype::invalid_input, funcname, "request nullptr"};
 
-   if (0 == snmp_sess_send(sessp, request))
+   int reqid = snmp_sess_send(sessp, request);
+   if (0 == reqid)
    {
       int liberr, syserr;
       char *errstr;
@@ -112,6 +154,16 @@ void async_send(void *sessp, netsnmp_pdu *request)
 
       throw snmplib_error {funcname, "snmp_sess_send failed: %s", errmsg.c_str()};
    }
+
+   return reqid;
+}
+
+// Timing is taken by net-snmp when request is sent, so it can be changed for already opened session.
+void set_timing(void *sessp, const peer_stats &stats)
+{
+   snmp_session *sess = snmp_sess_session(sessp);
+   sess->timeout = stats.timeout();
+   sess->retries = stats.retries();
 }
 
 std::string print_oid(const oid *oid, size_t oidsize)
@@ -143,6 +195,18 @@ std::string get_host_objid(void *sessp)
    return print_objid(response.pdu->variables);
 }
 
+// Same, but raw value is returned too. It's cheaper to compare with answers later.
+std::string get_host_objid(void *sessp, oid_handle &raw)
+{
+   pdu_handle response;
+   response = synch_request(sessp, oids::objid, oids::objid_size);
+
+   netsnmp_variable_list *vars = response.pdu->variables;
+   std::string objid {print_objid(vars)};
+   raw = oid_handle {vars->val.objid, vars->val_len / sizeof(oid)};
+   return objid;
+}
+
 std::vector<unsigned> get_nodes_bytype(void *sessp, const oid *oidst, size_t oidsize, const std::vector<unsigned> &match)
 {
    static const char *funcname {"snmp::get_nodes_bytype"};
@@ -251,4 +315,57 @@ intinfo get_intinfo(void *sessp, const intdata &ints)
    return info;
 }
 
+const std::vector<oid_vector> & intinfo_columns()
+{
+   static const std::vector<oid_vector> columns {
+      oid_vector(oids::iftype, oids::iftype + oids::iftype_size - 1),
+      oid_vector(oids::ifname, oids::ifname + oids::ifname_size - 1),
+      oid_vector(oids::ifalias, oids::ifalias + oids::ifalias_size - 1),
+      oid_vector(oids::ifoperstatus, oids::ifoperstatus + oids::ifoperstatus_size - 1),
+      oid_vector(oids::ifhighspeed, oids::ifhighspeed + oids::ifhighspeed_size - 1) };
+
+   return columns;
+}
+
+intinfo get_intinfo(void *sessp)
+{
+   return intinfo_from_table(walk_table(sessp, intinfo_columns()));
+}
+
+intinfo intinfo_from_table(const table &data)
+{
+   static const char *funcname {"snmp::intinfo_from_table"};
+   enum { type, name, alias, operstatus, highspeed };
+
+   // Interfaces without some of the columns are kept with empty values.
+   auto find = [&data](unsigned col, unsigned id, u_char asntype) -> const cell *
+   {
+      column::const_iterator it = data[col].find(id);
+      if (data[col].end() == it) return nullptr;
+      if (asntype != it->second.type)
+         throw snmprun_error {errtype::invalid_data, funcname, "unexpected ASN type in interface %u data", id};
+      return &(it->second);
+   };
+
+   intinfo info;
+   const cell *value;
+
+   for (auto &it : data[type])
+   {
+      if (ASN_INTEGER != it.second.type)
+         throw snmprun_error {errtype::invalid_data, funcname, "unexpected ASN type in answer to iftype"};
+      if (ethernetCsmacd != it.second.integer and gigabitEthernet != it.second.integer) continue;
+
+      info.emplace_back(it.first);
+      int_info_st &intf = info.back();
+
+      if (nullptr != (value = find(name, intf.id, ASN_OCTET_STR))) intf.name = value->string;
+      if (nullptr != (value = find(alias, intf.id, ASN_OCTET_STR))) intf.alias = value->string;
+      if (nullptr != (value = find(operstatus, intf.id, ASN_INTEGER))) intf.active = (1 == value->integer);
+      if (nullptr != (value = find(highspeed, intf.id, ASN_GAUGE))) intf.speed = value->integer;
+   }
+
+   return info;
+}
+
 } // SNMP NAMESPACE
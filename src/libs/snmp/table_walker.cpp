@@ -0,0 +1,213 @@
+#include <algorithm>
+
+#include <sys/select.h>
+
+#include "snmp/table_walker.h"
+
+namespace snmp {
+
+table_walker::table_walker(const std::vector<oid_vector> &columns, unsigned repetitions_) :
+   cols(columns.size()), data(columns.size()), repetitions{(0 == repetitions_) ? 1 : repetitions_}
+{
+   for (unsigned i = 0; i < columns.size(); i++) cols[i].root = cols[i].next = columns[i];
+}
+
+void table_walker::start(void *sessp_, netsnmp_callback callback_, void *magic_)
+{
+   sessp = sessp_;
+   callback = callback_;
+   magic = magic_;
+
+   proceed();
+}
+
+void table_walker::send(column_state &col)
+{
+   static const char *funcname {"snmp::table_walker::send"};
+
+   netsnmp_pdu *request = snmp_pdu_create(SNMP_MSG_GETBULK);
+   request->non_repeaters = 0;
+   request->max_repetitions = repetitions;
+   snmp_add_null_var(request, col.next.data(), col.next.size());
+
+   if (0 == (col.reqid = snmp_sess_async_send(sessp, request, callback, magic)))
+   {
+      snmp_free_pdu(request);
+      throw snmplib_error {funcname, "snmp_sess_async_send failed"};
+   }
+
+   outstanding++;
+}
+
+bool table_walker::owns(int reqid) const
+{
+   return cols.end() != std::find_if(cols.begin(), cols.end(),
+         [reqid](const column_state &col) { return reqid == col.reqid; });
+}
+
+// Walk is stopped, but outstanding requests are still waited for.
+void table_walker::fail(errtype type, const char *message)
+{
+   if (walkstate::failed == state_) return;
+   state_ = walkstate::failed;
+   error_type_ = type;
+   error_ = message;
+}
+
+// Checks answer status. Returns false if walk can't go on.
+bool table_walker::check(int operation, netsnmp_pdu *response)
+{
+   if (NETSNMP_CALLBACK_OP_RECEIVED_MESSAGE != operation) fail(errtype::timeout, "request timed out");
+   else if (SNMP_ERR_NOERROR != response->errstat) fail(errtype::snmp_error, "host returned error status");
+   return walkstate::failed != state_;
+}
+
+// Stores a single value of the column. Returns false when value is past the column's end.
+bool table_walker::store(column_state &col, netsnmp_variable_list *var)
+{
+   if (SNMP_ENDOFMIBVIEW == var->type or SNMP_NOSUCHOBJECT == var->type or SNMP_NOSUCHINSTANCE == var->type or
+         col.root.size() >= var->name_length or
+         0 != netsnmp_oid_is_subtree(col.root.data(), col.root.size(), var->name, var->name_length))
+   {
+      col.done = true;
+      return false;
+   }
+
+   // Agents which don't move forward would keep us walking forever.
+   if (0 <= snmp_oid_compare(col.next.data(), col.next.size(), var->name, var->name_length))
+   {
+      fail(errtype::invalid_data, "host returned OIDs out of order");
+      return false;
+   }
+
+   cell &value = data[&col - cols.data()][var->name[col.root.size()]];
+   value.type = var->type;
+
+   switch (var->type)
+   {
+      case ASN_INTEGER:
+      case ASN_COUNTER:
+      case ASN_GAUGE:
+      case ASN_TIMETICKS:
+         value.integer = (ASN_INTEGER == var->type) ? *(var->val.integer) : static_cast<u_long>(*(var->val.integer));
+         break;
+
+      case ASN_COUNTER64:
+         value.integer = (static_cast<unsigned long long>(var->val.counter64->high) << 32) | var->val.counter64->low;
+         break;
+
+      default:
+         value.string.assign(reinterpret_cast<char *>(var->val.string), var->val_len);
+   }
+
+   col.next.assign(var->name, var->name + var->name_length);
+   return true;
+}
+
+// Sends next requests for unfinished columns or marks the walk as done. Send failure only fails the walk:
+// requests which are already sent carry walker as their magic, so it has to wait for them like on any
+// other failure instead of unwinding its owner's stack.
+walkstate table_walker::proceed()
+{
+   bool done {true};
+
+   for (auto &col : cols)
+   {
+      if (col.done) continue;
+      done = false;
+      if (0 != col.reqid) continue;
+
+      try { send(col); }
+      catch (snmplib_error &error) { fail(errtype::runtime, error.what()); return state_; }
+   }
+
+   if (done) state_ = walkstate::done;
+   return state_;
+}
+
+walkstate table_walker::process(int operation, int reqid, netsnmp_pdu *response)
+{
+   std::vector<column_state>::iterator col = std::find_if(cols.begin(), cols.end(),
+         [reqid](const column_state &col) { return reqid == col.reqid; });
+   if (cols.end() == col) return state_;
+
+   col->reqid = 0;
+   outstanding--;
+   if (!check(operation, response)) return state_;
+
+   netsnmp_variable_list *vars = response->variables;
+   if (nullptr == vars) { fail(errtype::invalid_data, "host returned empty answer"); return state_; }
+
+   for (; nullptr != vars; vars = vars->next_variable) { if (!store(*col, vars)) break; }
+   if (walkstate::failed == state_) return state_;
+   return proceed();
+}
+
+netsnmp_pdu * table_walker::first_request() const
+{
+   netsnmp_pdu *request = snmp_pdu_create(SNMP_MSG_GETBULK);
+   request->non_repeaters = 0;
+   request->max_repetitions = std::max(1u, repetitions / static_cast<unsigned>(std::max<size_t>(1, cols.size())));
+   for (auto &col : cols) snmp_add_null_var(request, col.root.data(), col.root.size());
+   return request;
+}
+
+// Answer to GETBULK for all columns consists of rows, so varbinds go to columns in turn.
+walkstate table_walker::process_first(int operation, netsnmp_pdu *response, void *sessp_)
+{
+   sessp = sessp_;
+   callback = nullptr;
+   magic = nullptr;
+
+   if (!check(operation, response)) return state_;
+   if (nullptr == response->variables) { fail(errtype::invalid_data, "host returned empty answer"); return state_; }
+
+   unsigned i {};
+   for (netsnmp_variable_list *vars = response->variables; nullptr != vars; vars = vars->next_variable)
+   {
+      column_state &col = cols[i++ % cols.size()];
+      if (!col.done) store(col, vars);
+      if (walkstate::failed == state_) return state_;
+   }
+
+   return proceed();
+}
+
+extern "C" int walker_callback(int operation, snmp_session *, int reqid, netsnmp_pdu *pdu, void *magic)
+{
+   static_cast<table_walker *>(magic)->process(operation, reqid, pdu);
+   return 1;
+}
+
+table walk_table(void *sessp, const std::vector<oid_vector> &columns, unsigned repetitions)
+{
+   static const char *funcname {"snmp::walk_table"};
+   table_walker walker {columns, repetitions};
+
+   int fds, block, count;
+   fd_set fdset;
+   timeval timeout;
+
+   walker.start(sessp, walker_callback, &walker);
+   while (!walker.finished())
+   {
+      fds = 0;
+      block = 1;
+      FD_ZERO(&fdset);
+      timerclear(&timeout);
+
+      snmp_sess_select_info(sessp, &fds, &fdset, &timeout, &block);
+      count = select(fds, &fdset, nullptr, nullptr, block ? nullptr : &timeout);
+
+      if (0 < count) snmp_sess_read(sessp, &fdset);
+      else if (0 == count) snmp_sess_timeout(sessp);
+      else if (EINTR != errno)
+         throw snmprun_error {errtype::runtime, funcname, "select() failed: %s", strerror(errno)};
+   }
+
+   if (walkstate::failed == walker.state())
+      throw snmprun_error {walker.error_type(), funcname, "table walk failed: %s", walker.error()};
+   return std::move(walker.result());
+}
+
+} // NAMESPACE END
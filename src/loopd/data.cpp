@@ -1,11 +1,43 @@
+#include <algorithm>
+#include <cmath>
 #include <cstdint>
 #include <map>
+#include <mutex>
 
 #include "snmp/mux_poller.h"
 #include "snmp/oids.h"
 #include "prog_config.h"
 
 #include "data.h"
+#include "detect.h"
+#include "metrics.h"
+
+namespace {
+   // Callbacks are called concurrently from poller shards. Device data is touched by its own shard only,
+   // but the list of polled devices is shared.
+   std::mutex queue_lock;
+
+   // Devices answered during the current round. Their updated interfaces are checked for alarms
+   // by detect_alarms() once the round is over.
+   std::vector<device *> polled;
+
+   // Interfaces data gathered into contiguous arrays. Kept between rounds to avoid reallocations.
+   struct
+   {
+      std::vector<int_info *> ints;
+      std::vector<device *> devs;
+      std::vector<double> idle, in_bcmax, in_mavmax, in_spike;
+      std::vector<double> val, mav, prev, fill;
+      std::vector<double> clear, result;
+
+      void clear_all()
+      {
+         ints.clear(); devs.clear();
+         idle.clear(); in_bcmax.clear(); in_mavmax.clear(); in_spike.clear();
+         val.clear(); mav.clear(); prev.clear(); fill.clear();
+      }
+   } batch;
+}
 
 std::map<alarmtype, std::string> alarmtype_names {
    { alarmtype::bcmax,  "raw broadcast max"    },
@@ -13,6 +45,17 @@ std::map<alarmtype, std::string> alarmtype_names {
    { alarmtype::spike,  "spike on the average" }
 };
 
+snmp::poll_method configured_poll_method(bool followups)
+{
+   static const char *funcname {"configured_poll_method"};
+   const conf::string_t &method {config["snmp"]["poll-method"].get<conf::string_t>()};
+
+   if ("select" == method) return snmp::poll_method::select;
+   if ("epoll" == method) return snmp::poll_method::epoll;
+   if ("shared" == method) return followups ? snmp::poll_method::epoll : snmp::poll_method::shared;
+   throw logging::error {funcname, "unknown poll-method: '%s'", method.c_str()};
+}
+
 void prepare_request(device &dev)
 {
    static snmp::oid_handle ifbc {snmp::oids::ifbroadcast, snmp::oids::ifbroadcast_size};
@@ -21,67 +64,102 @@ void prepare_request(device &dev)
    snmp_add_null_var(dev.generic_req, snmp::oids::objid, snmp::oids::objid_size);
    snmp_add_null_var(dev.generic_req, snmp::oids::tticks, snmp::oids::tticks_size);
 
+   dev.slots.clear();
+   dev.slots.reserve(dev.ints.size());
+
    for (auto &intf : dev.ints)
    {
       ifbc[snmp::oids::ifbroadcast_size - 1] = intf.first;
       snmp_add_null_var(dev.generic_req, ifbc, snmp::oids::ifbroadcast_size);
+      dev.slots.push_back(&(intf.second));
    }
 }
 
-void check_alarm(int_info &it, device *dev, double mavsize)
+void detect_alarms()
 {
-   static const char *funcname {"check_alarm"};
-   static const conf::integer_t bcmax  {config["poller"]["bcmax"].get<conf::integer_t>()};
-   static const conf::integer_t mavmax {config["poller"]["mavmax"].get<conf::integer_t>()};
-   static const conf::integer_t mavlow {config["poller"]["mavlow"].get<conf::integer_t>()};   
-   static const double recover_ratio   {config["poller"]["recover-ratio"].get<conf::integer_t>() / 100.0};
+   static const char *funcname {"detect_alarms"};
+   static const double mavsize {static_cast<double>(3600 / config["poller"]["poll-interval"].get<conf::integer_t>())};
+   static const double bcmax  {static_cast<double>(config["poller"]["bcmax"].get<conf::integer_t>())};
+   static const double mavmax {static_cast<double>(config["poller"]["mavmax"].get<conf::integer_t>())};
+   static const double mavlow {static_cast<double>(config["poller"]["mavlow"].get<conf::integer_t>())};
+   static const double recover_ratio {config["poller"]["recover-ratio"].get<conf::integer_t>() / 100.0};
 
-   polldata &data = it.data;
-   bool check_reset {false};
+   batch.clear_all();
 
-   if (alarmtype::none != data.alarm)
+   for (device *dev : polled)
    {
-      double delta = data.mav_vals.front();
-      if ((alarmtype::bcmax  == data.alarm and delta < bcmax) or
-          (alarmtype::mavmax == data.alarm and data.lastmav < mavmax) or
-          (alarmtype::spike  == data.alarm and delta < (data.prevmav * recover_ratio)))
+      for (int_info *intf : dev->slots)
       {
-         logger.log_message(LOG_INFO, funcname, "%s: alarm cleared on interface %s - %s",
-               dev->host.c_str(), it.name.c_str(), it.alias.c_str());
+         polldata &data = intf->data;
+         if (!data.updated) continue;
+         data.updated = false;
+
+         batch.ints.push_back(intf);
+         batch.devs.push_back(dev);
+         batch.idle.push_back(alarmtype::none == data.alarm);
+         batch.in_bcmax.push_back(alarmtype::bcmax == data.alarm);
+         batch.in_mavmax.push_back(alarmtype::mavmax == data.alarm);
+         batch.in_spike.push_back(alarmtype::spike == data.alarm);
+         batch.val.push_back(data.lastval);
+         batch.mav.push_back(data.lastmav);
+         batch.prev.push_back(data.prevmav);
+         batch.fill.push_back(data.mav_vals.size());
+      }
+   }
+   polled.clear();
 
-         data.alarm = alarmtype::none;
-         data.lastmav = delta;
-         data.prevmav = 0;
+   size_t n = batch.ints.size();
+   batch.clear.resize(n);
+   batch.result.resize(n);
 
-         data.mav_vals.clear();
-         check_reset = true;
-      }
+   detect_clear(n, batch.in_bcmax.data(), batch.in_mavmax.data(), batch.in_spike.data(), batch.val.data(),
+         batch.mav.data(), batch.prev.data(), bcmax, mavmax, recover_ratio, batch.clear.data());
 
-      else return;
-   }
+   // Cleared interfaces are checked again from scratch, as if they never had an alarm.
+   for (size_t i = 0; i < n; i++)
+   {
+      if (0 == batch.clear[i]) continue;
+      int_info &it = *(batch.ints[i]);
+      polldata &data = it.data;
+
+      logger.log_message(LOG_INFO, funcname, "%s: alarm cleared on interface %s - %s",
+            batch.devs[i]->host.c_str(), it.name.c_str(), it.alias.c_str());
 
-   // Because our current MV data can be filled quite differently, depeding on daemon uptime,
-   // we're using different ratios. Starting from 80% and falling to 10% when we have data for an exactly hour.
-   double ratio = 0.8 - 0.7 * (data.mav_vals.size() / mavsize);
+      data.alarm = alarmtype::none;
+      data.lastmav = data.lastval;
+      data.prevmav = 0;
+      data.mav_vals.clear();
+
+      batch.idle[i] = 1;
+      batch.mav[i] = data.lastmav;
+      batch.prev[i] = batch.fill[i] = 0;
+   }
 
-   // So, we're firing an alarm if:
-   // A. Current raw broadcast pps on the interface is above bcmax constant.
-   // B. Current moving average level is above mavmax constant.
-   // C. We have some kind of spike on average data and current level is above low threshold.
-   if (bcmax < data.mav_vals.front()) data.alarm = alarmtype::bcmax;
-   else if (mavmax < data.lastmav) data.alarm = alarmtype::mavmax;
-   else if (0 != data.prevmav and mavlow < data.lastmav and (data.prevmav * ratio) < data.lastmav - data.prevmav) data.alarm = alarmtype::spike;
+   detect_fire(n, batch.idle.data(), batch.val.data(), batch.mav.data(), batch.prev.data(), batch.fill.data(),
+         bcmax, mavmax, mavlow, mavsize, batch.result.data());
 
-   if (alarmtype::none != data.alarm)
+   // Only interfaces which got a new alarm are left to be processed.
+   for (size_t i = 0; i < n; i++)
    {
-      if (check_reset) 
+      if (0 == batch.result[i]) continue;
+
+      int_info &it = *(batch.ints[i]);
+      device *dev = batch.devs[i];
+      polldata &data = it.data;
+      data.alarm = static_cast<alarmtype>(static_cast<int>(batch.result[i]));
+
+      if (0 != batch.clear[i]) 
       {
          logger.log_message(LOG_INFO, funcname, "%s: alarm on interface %s was cleared and reset to: %s", 
                dev->host.c_str(), it.name.c_str(), alarmtype_names[data.alarm].c_str());
-         return;
+         continue;
       }
 
+      dev->worker_refs++;
       alarm_queue.emplace_back(dev, &it);
+      metrics.alarms++;
+
+      double ratio = 0.8 - 0.7 * (batch.fill[i] / mavsize);
       logger.log_message(LOG_INFO, funcname, "%s: Detected abnormal broadcast pps level on interface %s - %s (%s)",
             dev->host.c_str(), it.name.c_str(), it.alias.c_str(), alarmtype_names[data.alarm].c_str());
       logger.log_message(LOG_INFO, funcname, "%s: PMAV: %f; MAV: %f; Diff: %f; Ratio: %f; DMAV: %f",
@@ -93,22 +171,11 @@ void calculate_datamav(int_info &it, int mavsize)
 {
    polldata &data = it.data;
    if (alarmtype::none == data.alarm) data.prevmav = data.lastmav;
-   int msize = data.mav_vals.size();
 
-   if (mavsize < msize)
-   {
-      data.lastmav = data.lastmav - (data.mav_vals.back() / mavsize) + (data.mav_vals.front() / mavsize);
-      data.mav_vals.pop_back();
-   }
+   data.mav_vals.push(data.lastval, mavsize);
+   data.lastmav = data.mav_vals.mean();
 
-   else
-   {
-      double sum {};
-      for (auto &x : data.mav_vals) sum += x;
-      data.lastmav = sum / msize;
-   }
-
-   it.rrdata.add_data(data.mav_vals.front(), data.lastmav);
+   it.rrdata.add_data(data.lastval, data.lastmav);
 }
 
 void process_intdata(device *dev, netsnmp_variable_list *vars, double timedelta)
@@ -120,45 +187,75 @@ void process_intdata(device *dev, netsnmp_variable_list *vars, double timedelta)
    static const uint64_t cmax {UINT64_MAX};
    static const double maxdelta {500000};
 
-   intsdata::iterator it;
+   static const size_t idpos {snmp::oids::ifbroadcast_size - 1};
+
+   int_info *intf;
    uint64_t counter;
    double delta;
 
+   // Varbinds are answered in the same order as they were requested, so interfaces are taken by position.
+   // Only the index is checked to catch broken agents.
    for (unsigned i = 0; nullptr != vars; vars = vars->next_variable, ++i)
    {
       if (ASN_COUNTER64 != vars->type)
          throw logging::error {funcname, "%s: unexpected ASN type in answer to ifbroadcast oid", dev->host.c_str()};
 
-      if (dev->ints.end() == (it = dev->ints.find(*(vars->name + 11))))
+      if (dev->slots.size() <= i or idpos >= vars->name_length or dev->slots[i]->id != vars->name[idpos])
          throw logging::error {funcname, "%s: host returned PDU with broadcast counter for unknown interface: %lu",
-            dev->host.c_str(), *(vars->name + 11)};
+            dev->host.c_str(), (idpos < vars->name_length) ? vars->name[idpos] : 0};
+      intf = dev->slots[i];
 
       counter = vars->val.counter64->high << 32 | vars->val.counter64->low;
-      if (0 == it->second.data.counter)
+      // Agent's uptime went backwards (reboot), so counters are started over.
+      if (0 == intf->data.counter or timedelta <= 0)
       {
-         it->second.data.counter = counter;
+         intf->data.counter = counter;
          continue;
       }
 
-      if (counter < it->second.data.counter)
+      if (counter < intf->data.counter)
       {
-         delta = (double) ((cmax - it->second.data.counter) + counter) / timedelta;
+         delta = (double) ((cmax - intf->data.counter) + counter) / timedelta;
 
          if (delta > maxdelta) 
          {
             logger.log_message(LOG_INFO, funcname, "%s: %u counter resetted - skipped.",
-               dev->host.c_str(), it->first);
-            it->second.data.counter = counter;
+               dev->host.c_str(), intf->id);
+            intf->data.counter = counter;
             continue;
          }
       }
-      else delta = (double) (counter - it->second.data.counter) / timedelta;
+      else delta = (double) (counter - intf->data.counter) / timedelta;
 
-      it->second.data.mav_vals.push_front(delta);
-      it->second.data.counter = counter;      
+      intf->data.lastval = delta;
+      intf->data.counter = counter;      
 
-      calculate_datamav(it->second, mavsize);
-      check_alarm(it->second, dev, mavsize);
+      calculate_datamav(*intf, mavsize);
+      intf->data.updated = true;
+   }
+}
+
+namespace {
+   // Agent's uptime since the previous answer, in seconds. Uptime is in hundredths of a second, which is precise
+   // enough for short intervals too, but it wraps every 497 days and starts over when agent is restarted.
+   // So it's used only while it agrees with the local time between the answers. Zero means that counters
+   // have to be started over. Devices restored from snapshot have no local time yet, uptime going
+   // backwards is the only thing which can be caught for them.
+   double uptime_delta(device *dev, uint32_t ticks, std::chrono::steady_clock::time_point now)
+   {
+      static const char *funcname {"uptime_delta"};
+      uint32_t last = static_cast<uint32_t>(dev->timeticks);
+
+      if (std::chrono::steady_clock::time_point {} == dev->received)
+         return std::max(0.0, (static_cast<double>(ticks) - last) / 100.0);
+
+      double local {std::chrono::duration<double>(now - dev->received).count()};
+      double agent {static_cast<uint32_t>(ticks - last) / 100.0};
+      if (std::abs(agent - local) <= std::max(1.0, local / 4)) return agent;
+
+      logger.log_message(LOG_INFO, funcname, "%s: uptime has changed by %.2fs in %.2fs, counters are started over",
+            dev->host.c_str(), agent, local);
+      return 0;
    }
 }
 
@@ -167,17 +264,24 @@ int callback(int operation, snmp_session *, int, netsnmp_pdu *pdu, void *magic,
    static const char *funcname {"callback"};
    device *dev = static_cast<device *>(magic);
 
+   const snmp::peer_stats *stats = poller.stats(dev->host);
+   if (nullptr != stats) dev->rtt = *stats;
+
    if (NETSNMP_CALLBACK_OP_RECEIVED_MESSAGE == operation)
    {
+      metrics.answers++;
+      // Answers to retried requests are not sampled, host may have no estimation yet.
+      if (nullptr != stats and 0 != stats->samples) metrics.host_rtt.observe(stats->srtt);
       netsnmp_variable_list *vars = pdu->variables;
-      std::string objid {snmp::print_objid(vars)};
 
-      if (objid != dev->objid)
+      if (!dev->objid_raw.matches_value(vars))
       {
          logger.log_message(LOG_INFO, funcname, "%s: device type has changed. "
                "PDU ignored. Device will be reinitialized.", dev->host.c_str());
          dev->state = hoststate::init;
-         action_queue.push_back(dev);
+
+         dev->worker_refs++;
+         action_queue.push(dev);
          return snmp::ok_close;
       }
 
@@ -185,16 +289,25 @@ int callback(int operation, snmp_session *, int, netsnmp_pdu *pdu, void *magic,
       if (ASN_TIMETICKS != vars->type)
          throw logging::error {funcname, "%s: unexpected ASN type in answer to timeticks", dev->host.c_str()};
 
-      int timedelta = (*(vars->val.integer) - dev->timeticks) / 100;
-      dev->timeticks = *(vars->val.integer);
+      std::chrono::steady_clock::time_point now {std::chrono::steady_clock::now()};
+      uint32_t ticks = static_cast<uint32_t>(*(vars->val.integer));
+      double timedelta {uptime_delta(dev, ticks, now)};
+      dev->timeticks = ticks;
+      dev->received = now;
       process_intdata(dev, vars->next_variable, timedelta);
+
+      std::lock_guard<std::mutex> lock {queue_lock};
+      polled.push_back(dev);
    }
 
    else
    {
       logger.log_message(LOG_INFO, funcname, "%s: device is unreachable.", dev->host.c_str());
+      metrics.timeouts++;
       dev->state = hoststate::unreachable;
-      action_queue.push_back(dev);
+
+      dev->worker_refs++;
+      action_queue.push(dev);
    }
 
    return snmp::ok_close;
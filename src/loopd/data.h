@@ -3,7 +3,9 @@
 
 #include <map>
 
+#include "snmp/sharded_poller.h"
 #include "prog_config.h"
+#include "mpsc_queue.h"
 #include "device.h"
 
 struct alarm_info
@@ -20,14 +22,23 @@ using devtasks = std::vector<device *>;
 using inttasks = std::vector<alarm_info>;
 
 extern devsdata devices;
+extern snmp::sharded_poller poller;
 
-// These are accessed with locks (worker.h)
-extern devtasks action_data, action_queue, return_data;
-extern inttasks alarm_data, alarm_queue;
+// Jobs for worker thread, handed over by main thread after each round (see worker.h).
+// Every queued job holds a reference to its device (device::worker_refs).
+extern mpsc_queue<device *> action_queue;    // Pushed from poller callbacks.
+extern inttasks alarm_queue;                 // Main thread only.
 
 extern std::map<alarmtype, std::string> alarmtype_names;
 
+// Method set by snmp/poll-method, for every poller loopd creates. Pollers whose callbacks send follow-up
+// requests get epoll instead of shared, it's not limited by FD_SETSIZE either.
+snmp::poll_method configured_poll_method(bool followups = false);
+
 int callback(int, snmp_session *, int, netsnmp_pdu *, void *, void *);
 void prepare_request(device &);
 
+// Should be called after each polling round, while callbacks are not running.
+void detect_alarms();
+
 #endif
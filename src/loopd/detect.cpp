@@ -0,0 +1,42 @@
+#include "device.h"
+#include "detect.h"
+
+namespace {
+   inline double mask(bool cond) { return cond ? 1.0 : 0.0; }
+}
+
+void detect_clear(size_t n, const double *in_bcmax, const double *in_mavmax, const double *in_spike,
+      const double *val, const double *mav, const double *prev,
+      double bcmax, double mavmax, double recover_ratio, double *clear)
+{
+   for (size_t i = 0; i < n; i++)
+   {
+      clear[i] = in_bcmax[i]  * mask(val[i] < bcmax) +
+                 in_mavmax[i] * mask(mav[i] < mavmax) +
+                 in_spike[i]  * mask(val[i] < prev[i] * recover_ratio);
+   }
+}
+
+// Because our current MV data can be filled quite differently, depeding on daemon uptime,
+// we're using different ratios. Starting from 80% and falling to 10% when we have data for an exactly hour.
+// So, we're firing an alarm if:
+// A. Current raw broadcast pps on the interface is above bcmax constant.
+// B. Current moving average level is above mavmax constant.
+// C. We have some kind of spike on average data and current level is above low threshold.
+void detect_fire(size_t n, const double *idle, const double *val, const double *mav, const double *prev,
+      const double *fill, double bcmax, double mavmax, double mavlow, double mavsize, double *result)
+{
+   static const double a_code {static_cast<double>(alarmtype::bcmax)};
+   static const double b_code {static_cast<double>(alarmtype::mavmax)};
+   static const double c_code {static_cast<double>(alarmtype::spike)};
+
+   for (size_t i = 0; i < n; i++)
+   {
+      double ratio = 0.8 - 0.7 * (fill[i] / mavsize);
+      double a = mask(bcmax < val[i]);
+      double b = mask(mavmax < mav[i]);
+      double c = mask(0 < prev[i]) * mask(mavlow < mav[i]) * mask(prev[i] * ratio < mav[i] - prev[i]);
+
+      result[i] = idle[i] * (a * a_code + (1 - a) * (b * b_code + (1 - b) * c * c_code));
+   }
+}
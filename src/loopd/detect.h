@@ -0,0 +1,19 @@
+#ifndef LOOPD_DETECT_H
+#define LOOPD_DETECT_H
+
+#include <cstddef>
+
+// Alarm detection kernels. Every array holds one value per interface, states are passed as 0/1 masks
+// and results are returned the same way, so loops are free of branches and are vectorized
+// by compiler (see CMakeLists.txt for the flags this file is built with).
+
+// Interfaces in alarm which are back to normal.
+void detect_clear(size_t n, const double *in_bcmax, const double *in_mavmax, const double *in_spike,
+      const double *val, const double *mav, const double *prev,
+      double bcmax, double mavmax, double recover_ratio, double *clear);
+
+// New alarms for interfaces which are not in alarm (idle), result is alarmtype value or zero.
+void detect_fire(size_t n, const double *idle, const double *val, const double *mav, const double *prev,
+      const double *fill, double bcmax, double mavmax, double mavlow, double mavsize, double *result);
+
+#endif
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <chrono>
 #include <locale>
 #include <memory>
@@ -6,11 +7,33 @@
 #include <sys/types.h>
 
 #include "snmp/snmp.h"
+#include "snmp/bulk_walker.h"
 #include "aux_log.h"
 #include "prog_config.h"
 #include "zbx_api.h"
 
+#include "data.h"
 #include "device.h"
+#include "metrics.h"
+#include "shard_ring.h"
+
+namespace {
+   // Devices of the whole fleet are split between loopd instances, see shard_ring.h.
+   // Set once at startup, before updater thread is started.
+   shard_ring sharding;
+   unsigned this_shard {};
+}
+
+void set_sharding(unsigned shard, unsigned shards, unsigned vnodes)
+{
+   sharding = shard_ring {shards, vnodes};
+   this_shard = shard;
+}
+
+bool in_shard(const std::string &host)
+{
+   return this_shard == sharding.owner(host);
+}
 
 // And hope for the best.
 // Current compiler doesn't support fancy codecvt and other stuff.
@@ -41,7 +64,8 @@ void create_device(devsdata &devices, const std::string &host, const std::string
 
    if (devices.end() != it)
    {
-      if (it->second.name != name or it->second.community != community)
+      // Devices held by worker come without community (see snapshot_devices in main.cpp).
+      if (it->second.name != name or (!it->second.community.empty() and it->second.community != community))
          logger.log_message(LOG_INFO, funcname, "Device updated %s: '%s' - %s",
                host.c_str(), name.c_str(), community.c_str());
 
@@ -70,6 +94,7 @@ void parse_zbxdata(devsdata &devices, zbx_api::api_session &zbx_sess)
    static const char *funcname {"parse_zbxdata"};
    buffer jsonpath, result;
    std::string host, name, community;
+   unsigned foreign {};
 
    for (int i = 0; ;i++)
    {
@@ -106,8 +131,12 @@ void parse_zbxdata(devsdata &devices, zbx_api::api_session &zbx_sess)
          break;
       }
 
+      // Devices of other shards are not created. If they were ours before, they are left delmarked.
+      if (!in_shard(host)) { foreign++; continue; }
       create_device(devices, host, name, community);
    }
+
+   if (0 != foreign) logger.log_message(LOG_INFO, funcname, "%u hosts belong to other shards", foreign);
 }
 
 void init_device(device &devdata)
@@ -117,12 +146,14 @@ void init_device(device &devdata)
 
    const char *host = devdata.host.c_str();
    snmp::sess_handle sessp;
+   snmp::oid_handle objid_raw;
    std::string objid;
 
    try
    {
       sessp = snmp::init_snmp_session(host, devdata.community.c_str());
-      objid = snmp::get_host_objid(sessp);
+      snmp::set_timing(sessp, devdata.rtt);
+      objid = snmp::get_host_objid(sessp, objid_raw);
    }
 
    catch (snmp::snmprun_error &error)
@@ -139,7 +170,8 @@ void init_device(device &devdata)
       {
          logger.log_message(LOG_INFO, funcname, "%s: retrying device with default SNMP community.", host);
          sessp = snmp::init_snmp_session(host, defcom.c_str());
-         objid = snmp::get_host_objid(sessp);
+         snmp::set_timing(sessp, devdata.rtt);
+         objid = snmp::get_host_objid(sessp, objid_raw);
          devdata.community = defcom;
       }
 
@@ -152,6 +184,14 @@ void init_device(device &devdata)
       }
    }
 
+   set_type(devdata, objid, objid_raw);
+}
+
+void set_type(device &devdata, const std::string &objid, snmp::oid_handle &objid_raw)
+{
+   static const char *funcname {"set_type"};
+   const char *host = devdata.host.c_str();
+
    if (!devdata.objid.empty() and objid != devdata.objid)
    {
       logger.log_message(LOG_INFO, funcname, "%s: device type has changed from %s to %s",
@@ -160,6 +200,7 @@ void init_device(device &devdata)
    }
 
    devdata.objid = objid;
+   devdata.objid_raw = std::move(objid_raw);
    devdata.state = hoststate::enabled;
    logger.log_message(LOG_INFO, funcname, "%s: device initialized with type: %s", host, objid.c_str());   
 }
@@ -167,14 +208,13 @@ void init_device(device &devdata)
 void update_ints(device &devdata)
 {
    static const char *funcname {"update_ints"};
-   static const conf::integer_t seconds {config["poller"]["poll-interval"].get<conf::integer_t>()};
    snmp::intinfo info;
 
    try
    {
       snmp::sess_handle sessp {snmp::init_snmp_session(devdata.host.c_str(), devdata.community.c_str())};
-      snmp::intdata ints {snmp::get_host_physints(sessp)};
-      info = snmp::get_intinfo(sessp, ints);
+      snmp::set_timing(sessp, devdata.rtt);
+      info = snmp::get_intinfo(sessp);
    }
 
    catch (snmp::snmprun_error &error)
@@ -185,7 +225,14 @@ void update_ints(device &devdata)
       devdata.state = hoststate::unreachable;
    }
 
-   buffer rrdpath;
+   update_ints(devdata, info);
+}
+
+void update_ints(device &devdata, const snmp::intinfo &info)
+{
+   static const char *funcname {"update_ints"};
+   static const conf::integer_t seconds {config["poller"]["poll-interval"].get<conf::integer_t>()};
+
    for (auto &intf : devdata.ints) intf.second.delmark = true;
 
    for (auto &inti : info)
@@ -208,11 +255,152 @@ void update_ints(device &devdata)
             devdata.host.c_str(), inti.id, inti.name.c_str(), inti.alias.c_str());
       it.name = inti.name;
 
-      rrdpath.print("%s/%u.rrd", devdata.rrdpath.c_str(), inti.id);
-      it.rrdata.init(rrdpath.data(), seconds);
+      it.rrdata.init(devdata.rrdpath, inti.id, seconds);
    }
 }
 
+namespace {
+   // Progress of a single update phase, logged every 10% of devices.
+   struct phase_progress
+   {
+      const char *name;
+      size_t total;
+      size_t done {};
+      std::chrono::steady_clock::time_point start {std::chrono::steady_clock::now()};
+
+      phase_progress(const char *name_, size_t total_) : name{name_}, total{total_} { }
+
+      void step()
+      {
+         static const char *funcname {"update_devdata"};
+         done++;
+         if (0 != done % std::max<size_t>(1, total / 10) and total != done) return;
+
+         std::chrono::duration<double> elapsed {std::chrono::steady_clock::now() - start};
+         logger.log_message(LOG_INFO, funcname, "%s: %lu of %lu devices done in %fs", name, done, total, elapsed.count());
+      }
+   };
+
+   struct update_task
+   {
+      device *dev;
+      phase_progress *progress;
+      bool failed {false};
+
+      update_task(device *dev_, phase_progress *progress_) : dev{dev_}, progress{progress_} { }
+   };
+
+   int init_callback(int operation, snmp_session *, int, netsnmp_pdu *pdu, void *magic, void *)
+   {
+      static const char *funcname {"init_device"};
+      update_task &task = *static_cast<update_task *>(magic);
+
+      netsnmp_variable_list *vars = (NETSNMP_CALLBACK_OP_RECEIVED_MESSAGE == operation) ? pdu->variables : nullptr;
+      if (nullptr == vars or SNMP_ERR_NOERROR != pdu->errstat or ASN_OBJECT_ID != vars->type)
+      {
+         if (nullptr != vars) logger.log_message(LOG_INFO, funcname, "%s: unexpected answer to device type request",
+               task.dev->host.c_str());
+         task.failed = true;
+         return snmp::ok_close;
+      }
+
+      snmp::oid_handle objid_raw {vars->val.objid, vars->val_len / sizeof(oid)};
+      set_type(*(task.dev), snmp::print_objid(vars), objid_raw);
+      task.failed = false;
+      task.progress->step();
+      return snmp::ok_close;
+   }
+
+   void walk_callback(const std::string &host, snmp::walkstate state, snmp::table &data, void *magic)
+   {
+      static const char *funcname {"update_ints"};
+      update_task &task = *static_cast<update_task *>(magic);
+      task.progress->step();
+
+      if (snmp::walkstate::done == state)
+      {
+         try { update_ints(*(task.dev), snmp::intinfo_from_table(data)); return; }
+
+         catch (snmp::snmprun_error &error) {
+            logger.log_message(LOG_WARNING, funcname, "%s: device's interfaces update failed: %s", host.c_str(), error.what());
+         }
+      }
+
+      else logger.log_message(LOG_WARNING, funcname, "%s: device's interfaces update failed", host.c_str());
+
+      // Interfaces are left as they are, main thread keeps polling the device if it's already known.
+      task.dev->state = hoststate::unreachable;
+   }
+}
+
+// Asks all devices for their type at once. Devices which didn't answer are tried again with the default community.
+void init_devices(std::vector<device *> &devs, unsigned max_hosts)
+{
+   static const char *funcname {"init_device"};
+   static const conf::string_t &defcom {config["snmp"]["default-community"].get<conf::string_t>()};
+
+   phase_progress progress {"device init", devs.size()};
+   std::vector<update_task> tasks;
+   tasks.reserve(devs.size());
+
+   netsnmp_pdu *request = snmp_pdu_create(SNMP_MSG_GET);
+   snmp_add_null_var(request, snmp::oids::objid, snmp::oids::objid_size);
+
+   for (unsigned round = 0; round < 2; round++)
+   {
+      snmp::mux_poller poller {max_hosts, configured_poll_method()};
+
+      for (auto dev : devs)
+      {
+         if (1 == round and (hoststate::enabled == dev->state or dev->community == defcom)) continue;
+         if (1 == round) logger.log_message(LOG_INFO, funcname, "%s: retrying device with default SNMP community.",
+               dev->host.c_str());
+
+         tasks.emplace_back(dev, &progress);
+         poller.add(dev->host.c_str(), (0 == round) ? dev->community.c_str() : defcom.c_str(),
+               request, init_callback, &(tasks.back()));
+      }
+
+      poller.poll();
+      for (auto &it : tasks)
+      {
+         const snmp::peer_stats *stats = poller.stats(it.dev->host);
+         if (nullptr != stats) it.dev->rtt = *stats;
+         if (1 == round and !it.failed) it.dev->community = defcom;
+      }
+
+      tasks.clear();
+   }
+
+   snmp_free_pdu(request);
+
+   for (auto dev : devs)
+   {
+      if (hoststate::enabled == dev->state) continue;
+      logger.log_message(LOG_INFO, funcname, "%s: device is not responding with any of known communities.", dev->host.c_str());
+      dev->state = hoststate::unreachable;
+      progress.step();
+   }
+}
+
+// Walks interface tables of all devices at once.
+void walk_devices(std::vector<device *> &devs, unsigned max_hosts)
+{
+   phase_progress progress {"interfaces update", devs.size()};
+   std::vector<update_task> tasks;
+   tasks.reserve(devs.size());
+
+   // Walker sends follow-up requests, so shared sockets are replaced by epoll.
+   snmp::bulk_walker walker {max_hosts, configured_poll_method(true)};
+   for (auto dev : devs)
+   {
+      tasks.emplace_back(dev, &progress);
+      walker.add(dev->host.c_str(), dev->community.c_str(), snmp::intinfo_columns(), walk_callback, &(tasks.back()));
+   }
+
+   walker.walk();
+}
+
 void update_devdata(devsdata *devices)
 {
    static const char *funcname {"update_devdata"};
@@ -246,15 +434,31 @@ void update_devdata(devsdata *devices)
       parse_zbxdata(*devices, zbx_sess);  
    }
 
+   // Devices are initialized and walked concurrently, update takes about as long as the slowest device.
+   static const unsigned max_hosts {static_cast<unsigned>(config["snmp"]["update-hosts"].get<conf::integer_t>())};
+
    unsigned delmark {}, inactive {};
+   std::vector<device *> fresh, active;
+
    for (auto &device : *devices)
    {
       if (device.second.delmark) { delmark++; continue; };
-      if (hoststate::init == device.second.state) init_device(device.second);
-      if (hoststate::enabled != device.second.state) { inactive++; continue; }
-      update_ints(device.second);
+      if (hoststate::init == device.second.state) fresh.push_back(&(device.second));
+   }
+
+   init_devices(fresh, max_hosts);
+
+   for (auto &device : *devices)
+   {
+      if (device.second.delmark or hoststate::enabled != device.second.state) continue;
+      active.push_back(&(device.second));
    }
 
+   walk_devices(active, max_hosts);
+
+   for (auto &device : *devices)
+      if (!device.second.delmark and hoststate::enabled != device.second.state) inactive++;
+
    // So we have updated datamap of devices with corresponding interfaces. Devices which were not received again from zabbix are
    // marked to be deleted. Same thing with interfaces. Since updating is performed in a separate thread, we're not
    // actually releasing any resources from here. Main thread will be signaled that data is updated. It will check any
@@ -267,6 +471,7 @@ void update_devdata(devsdata *devices)
 void update_devices(devsdata *devices, std::atomic<bool> &updating)
 {
    static const char *funcname {"update_devices"};
+   std::chrono::steady_clock::time_point start {std::chrono::steady_clock::now()};
 
    try { update_devdata(devices); }
 
@@ -278,5 +483,6 @@ void update_devices(devsdata *devices, std::atomic<bool> &updating)
       logger.error_exit(funcname, "Updater thread aborted by generic catch clause.");
    }
 
+   metrics.updater_duration.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
    updating = false;
 }
@@ -4,10 +4,13 @@
 #include <string>
 #include <unordered_map>
 #include <atomic>
-#include <deque>
+#include <chrono>
+#include <memory>
+#include <vector>
 
 #include "snmp/snmp.h"
 #include "lrrd.h"
+#include "mav_window.h"
 
 enum class alarmtype
 {
@@ -21,15 +24,18 @@ struct polldata
 {
    alarmtype alarm  {alarmtype::none};
    uint64_t counter {};
+   double lastval   {};    // Latest broadcast rate sample.
    double lastmav   {};
    double prevmav   {};
-   std::deque<double> mav_vals;
+   mav_window mav_vals;
+   bool updated {false};   // Got a new sample during the current round.
 
    void reset() 
    { 
       alarm = alarmtype::none;      
       counter = 0; 
-      lastmav = prevmav = 0; 
+      lastval = lastmav = prevmav = 0; 
+      updated = false;
       mav_vals.clear();
    }
 };
@@ -50,6 +56,15 @@ struct int_info
 using intsdata = std::unordered_map<unsigned, int_info>;
 using intpair = std::pair<unsigned, int_info>;
 
+// Changes of a single device found by updater thread.
+struct device_update
+{
+   std::string name;
+   std::string community;
+   bool walked {false};    // Interfaces were actually walked, 'ints' is a complete new list.
+   intsdata ints;
+};
+
 enum class hoststate
 {
    init,         // Freshly added device - needs to be polled for additional data.
@@ -64,29 +79,48 @@ struct device
    std::string community;
    std::string rrdpath;
    std::string objid;
+   snmp::oid_handle objid_raw;    // Same as objid. Compared with every answer, so no formatting is needed.
 
    hoststate state {hoststate::init};
    bool delmark {false};
 
    intsdata ints;
    snmp::pdu_handle generic_req;
+   std::vector<int_info *> slots;   // Interfaces in the same order as their varbinds in generic_req.
 
    // Timeticks are used to actually get timeticks while device is enabled.
    // If it's in unreachable or disabled state, timeticks holds time of the next polling try.
    time_t timeticks {0};
    unsigned wait_backoff {1};
 
+   // Local time of the answer with the last timeticks, agent's uptime is checked against it.
+   std::chrono::steady_clock::time_point received {};
+
+   // Last known poller's RTT estimation. Used for timing of worker's requests and its backoff.
+   snmp::peer_stats rtt;
+
+   // Number of tasks and alarms for this device handed over to worker thread. Main thread changes
+   // or deletes device only when worker holds no references to it, until then changes wait in 'pending'.
+   std::atomic<unsigned> worker_refs {0};
+   std::atomic<bool> dropped {false};
+   std::unique_ptr<device_update> pending;
+
    device(const std::string &host_, const std::string &name_, const std::string &community_, const std::string &rrdpath_) :
       host{host_}, name{name_}, community{community_}, rrdpath{rrdpath_} { }
 
-   void reset() { timeticks = 0; wait_backoff = 1; for (auto &it : ints) it.second.reset(); }
+   void reset() { timeticks = 0; received = {}; wait_backoff = 1; for (auto &it : ints) it.second.reset(); }
 };
 
 using devsdata = std::unordered_map<std::string, device>;
 using devpair = std::pair<const std::string, device>;
 
 void update_devices(devsdata *, std::atomic<bool> &);
+// Only hosts of this instance's shard (zero-based, out of 'shards') are loaded by device update.
+void set_sharding(unsigned shard, unsigned shards, unsigned vnodes);
+bool in_shard(const std::string &host);
 void init_device(device &devdata);
+void set_type(device &devdata, const std::string &objid, snmp::oid_handle &objid_raw);
 void update_ints(device &devdata);
+void update_ints(device &devdata, const snmp::intinfo &info);
 
 #endif
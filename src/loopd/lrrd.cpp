@@ -1,60 +1,135 @@
+#include <chrono>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 #include <rrd.h>
 
 #include "aux_log.h"
+#include "mpsc_queue.h"
+#include "metrics.h"
 #include "lrrd.h"
 
+namespace {
+   // librrd keeps its state (getopt, error buffer) in globals. RRDs are updated by writer thread and
+   // graphs are drawn by worker thread, so every call into the library is serialized.
+   std::mutex liblock;
+
+   // Rendered graphs by RRD path and time step.
+   using graph_key = std::pair<std::string, time_t>;
+   std::mutex cachelock;
+   std::map<graph_key, std::shared_ptr<const std::string>> graph_cache;
+
+   struct rrd_sample
+   {
+      std::string path;
+      time_t ts;
+      double val;
+      double mav;
+   };
+
+   // Samples from poller callbacks. Writing them is left to a separate thread, so polling
+   // never waits for disk.
+   mpsc_queue<rrd_sample> write_queue;
+   std::once_flag writer_started;
+
+   struct rrd_updates
+   {
+      time_t last {};
+      std::vector<std::string> values;
+   };
+
+   void write_updates(const std::string &path, rrd_updates &upd)
+   {
+      static const char *funcname {"rrd_writer"};
+
+      std::vector<const char *> argv;
+      argv.reserve(upd.values.size());
+      for (auto &it : upd.values) argv.push_back(it.c_str());
+
+      std::lock_guard<std::mutex> lock {liblock};
+      std::chrono::steady_clock::time_point start {std::chrono::steady_clock::now()};
+      int result = rrd_update_r(path.c_str(), nullptr, argv.size(), argv.data());
+      metrics.rrd_write.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+
+      if (rrd_test_error() or 0 != result)
+      {
+         metrics.rrd_errors++;
+         logger.log_message(LOG_ERR, funcname, "RRD Update error for '%s' (%lu samples): %s",
+               path.c_str(), upd.values.size(), rrd_get_error());
+         rrd_clear_error();
+         return;
+      }
+
+      metrics.rrd_samples += argv.size();
+   }
+
+   // Everything queued since the last pass is grouped by file, so when writer falls behind
+   // each RRD still gets a single update call with all its samples.
+   void rrd_writer()
+   {
+      static const std::chrono::milliseconds idle {100};
+      std::unordered_map<std::string, rrd_updates> updates;
+      buffer datastr;
+
+      for (;;)
+      {
+         size_t count = write_queue.consume([&](rrd_sample &s) {
+               rrd_updates &upd = updates[s.path];
+               // librrd refuses the whole batch if timestamps are not strictly increasing.
+               if (s.ts <= upd.last) return;
+               datastr.print("%ld:%f:%f", static_cast<long>(s.ts), s.val, s.mav);
+               upd.values.emplace_back(datastr.data());
+               upd.last = s.ts;
+            });
+
+         for (auto &it : updates) write_updates(it.first, it.second);
+         updates.clear();
+
+         if (0 == count) std::this_thread::sleep_for(idle);
+      }
+   }
+}
+
+storage_type rrd::storage {storage_type::rrd};
+
 const char * rrd::create_params[] = {
    "rrdcreate",
    "--step",
    nullptr,
+   "--start",
    nullptr,
    nullptr,
    nullptr,
    nullptr,
-   nullptr
-};
-
-const char * rrd::update_params[] = {
-   "rrdupdate",
-   nullptr,
    nullptr,
    nullptr
 };
 
-const char * rrd::graph_params[] = {
-   "rrdgraph",
-   nullptr,     // Graph path   
-   "--end",
-   nullptr,
-   "--height",
-   nullptr,
-   "--width",
-   nullptr,
-   "--title",
-   nullptr,     // Title
-   "--vertical-label=broadcast pps",
-   nullptr,     // DEF:bc [10]
-   nullptr,     // DEF:mv [11]
-   "LINE1:bc#B8B8B8",
-   "LINE1:mv#000000",
-   "GPRINT:bc:LAST:Last bps value\\: \%8.2lf \%s",
-   "GPRINT:mv:LAST:Moving average (1Hr)\\: \%8.2lf \%s",
-   nullptr
-};
-
-void rrd::init(const char *rrdpath_, unsigned step_)
+void rrd::init(const std::string &devdir, unsigned id, unsigned step_)
 {
    static const char *funcname {"rrd::init"};
    struct stat stbuf;
 
    step = step_;
-   rrdpath = rrdpath_;
+   rrdpath = devdir + '/' + std::to_string(id) + ".rrd";
+
+   if (storage_type::ring == storage)
+   {
+      ring = std::make_shared<ring_store>(devdir + "/ints.ring", id, step, (86400 / step) + 10);
+      valid = true;
+      return;
+   }
 
    if (-1 == stat(rrdpath.c_str(), &stbuf))
    {
-      if (ENOENT == errno) create();
+      if (ENOENT == errno) create(rrdpath.c_str(), time(nullptr) - 10);
       else throw logging::error {funcname, "cannot stat path '%s': %s",
          rrdpath.c_str(), strerror(errno)};
    }
@@ -64,24 +139,27 @@ void rrd::init(const char *rrdpath_, unsigned step_)
    // If not, then only way is to recreate RRD and flush all interface data.
 }
 
-void rrd::create()
+void rrd::create(const char *path, time_t start)
 {
    static const char *funcname {"rrd::create"};
 
-   buffer seconds, ds1, ds2, rra;
+   buffer seconds, startstr, ds1, ds2, rra;
    seconds.print("%d", step);
+   startstr.print("%ld", static_cast<long>(start));
    ds1.print("DS:broadcast:GAUGE:%lu:0:U", (unsigned long) (step * 1.2));
    ds2.print("DS:maverage:GAUGE:%lu:0:U", (unsigned long) (step * 1.2));
    rra.print("RRA:LAST:0:1:%u", (86400 / step) + 10); // 24 hours of data + 10 to be sure
 
+   std::lock_guard<std::mutex> lock {liblock};
    create_params[2] = seconds.data();
-   create_params[3] = rrdpath.c_str();
-   create_params[4] = ds1.data();
-   create_params[5] = ds2.data();
-   create_params[6] = rra.data();   
+   create_params[4] = startstr.data();
+   create_params[5] = path;
+   create_params[6] = ds1.data();
+   create_params[7] = ds2.data();
+   create_params[8] = rra.data();   
 
    optind = opterr = 0;
-   int result = rrd_create(7, const_cast<char **>(create_params));
+   int result = rrd_create(9, const_cast<char **>(create_params));
    if (rrd_test_error() or 0 != result) 
       throw logging::error {funcname, "RRD Create error: %s", rrd_get_error()};
 }
@@ -91,15 +169,17 @@ void rrd::add_data(double val, double mav)
    static const char *funcname {"rrd::add_data"};
    if (!valid) throw logging::error {funcname, "attempt to add data to uninitialized RRD set."};
 
-   buffer datastr;
-   datastr.print("N:%f:%f", val, mav);
-   update_params[1] = rrdpath.c_str();
-   update_params[2] = datastr.data();
+   if (storage_type::ring == storage)
+   {
+      std::chrono::steady_clock::time_point start {std::chrono::steady_clock::now()};
+      ring->append(time(nullptr), val, mav);
+      metrics.rrd_write.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+      metrics.rrd_samples++;
+      return;
+   }
 
-   optind = opterr = 0;
-   int result = rrd_update(3, const_cast<char **>(update_params));
-   if (rrd_test_error() or 0 != result)
-      throw logging::error {funcname, "RRD Update error: %s", rrd_get_error()};
+   std::call_once(writer_started, [] { std::thread {rrd_writer}.detach(); });
+   write_queue.push(rrd_sample {rrdpath, time(nullptr), val, mav});
 }
 
 void rrd::remove()
@@ -107,62 +187,138 @@ void rrd::remove()
    static const char *funcname {"rrd::remove"};
    if (!valid) throw logging::error {funcname, "attempt to remove uninitialized RRD set."};
 
-   if (-1 == ::remove(rrdpath.c_str()))
+   if (storage_type::ring == storage)
+   {
+      ring->remove();
+      ring.reset();
+   }
+
+   else if (-1 == ::remove(rrdpath.c_str()))
       throw logging::error {funcname, "failed to remove RRD file '%s': %s",
          rrdpath.c_str(), strerror(errno)};
    valid = false;
 }
 
-void rrd::graph(const char *filename, const char *title, int xsize, int ysize)
+// Builds a temporary RRD from ring data, so graphs look the same with both storages.
+// Samples are fed to librrd with a single update call. Path should be unique, it's overwritten.
+void rrd::export_rrd(const std::string &path)
+{
+   static const char *funcname {"rrd::export_rrd"};
+
+   std::vector<ring_store::sample> samples {ring->samples()};
+   time_t last = samples.empty() ? time(nullptr) - 10 : samples.front().ts - 1;
+
+   create(path.c_str(), last);
+   if (samples.empty()) return;
+
+   buffer datastr;
+   std::vector<std::string> values;
+   values.reserve(samples.size());
+
+   // librrd refuses samples which are not strictly after the previous one.
+   for (auto &it : samples)
+   {
+      if (it.ts <= last) continue;
+      datastr.print("%ld:%f:%f", static_cast<long>(it.ts), it.bc, it.mav);
+      values.emplace_back(datastr.data());
+      last = it.ts;
+   }
+
+   std::vector<const char *> params {"rrdupdate", path.c_str()};
+   for (auto &it : values) params.push_back(it.c_str());
+   params.push_back(nullptr);
+
+   std::lock_guard<std::mutex> lock {liblock};
+   optind = opterr = 0;
+   int result = rrd_update(params.size() - 1, const_cast<char **>(params.data()));
+   if (rrd_test_error() or 0 != result)
+      throw logging::error {funcname, "RRD Update error: %s", rrd_get_error()};
+}
+
+std::shared_ptr<const std::string> rrd::graph(const char *title, int xsize, int ysize)
 {
    static const char *funcname {"rrd::graph"};
    if (!valid) throw logging::error {funcname, "attempt to generate graph from uninitialized RRD set."};
-   buffer temp;
 
-   // Somehow librrd tends to screw all input parameters. And i can't event understand logic behind it.
-   // So we're making a whole new copy of parameters to pass on to librrd.
-   size_t psize = sizeof(graph_params) / sizeof(char *);
-   const char **params = new const char*[psize]();
+   // Graph changes only when a new sample is written, so every alarm within a single step
+   // gets the same picture.
+   const graph_key key {rrdpath, time(nullptr) / step};
+   {
+      std::lock_guard<std::mutex> lock {cachelock};
+      auto it = graph_cache.find(key);
+      if (graph_cache.end() != it) return it->second;
+   }
 
-   for (unsigned i = 0; i < psize; i++) 
+   std::string source {rrdpath};
+   // Several graphs of the same interface may be drawn at once, so every one gets its own export.
+   if (storage_type::ring == storage)
    {
-      if (nullptr == graph_params[i]) continue;
-      params[i] = new char[strlen(graph_params[i]) + 1]; 
-      strcpy(const_cast<char *>(params[i]), graph_params[i]);
+      source = rrdpath + ".export.XXXXXX";
+      int fd = mkstemp(&source[0]);
+      if (-1 == fd) throw logging::error {funcname, "failed to create temporary file for '%s': %s",
+         rrdpath.c_str(), strerror(errno)};
+      close(fd);
+
+      try { export_rrd(source); }
+      catch (...) { ::remove(source.c_str()); throw; }
    }
 
-   temp.print(filename);
-   params[1] = temp.clone();
+   buffer temp;
+   std::vector<std::string> params {"rrdgraph", "-", "--imgformat", "PNG"};
 
    temp.print("%lu", time(nullptr) + step * 2);
-   params[3] = temp.clone();
-
+   params.insert(params.end(), {"--end", temp.data()});
    temp.print("%d", ysize);
-   params[5] = temp.clone();
-
+   params.insert(params.end(), {"--height", temp.data()});
    temp.print("%d", xsize);
-   params[7] = temp.clone();
+   params.insert(params.end(), {"--width", temp.data()});
+   params.insert(params.end(), {"--title", title, "--vertical-label=broadcast pps"});
 
-   temp.print(title);
-   params[9] = temp.clone();
+   temp.print("DEF:bc=%s:broadcast:LAST", source.c_str());
+   params.emplace_back(temp.data());
+   temp.print("DEF:mv=%s:maverage:LAST", source.c_str());
+   params.emplace_back(temp.data());
 
-   temp.print("DEF:bc=%s:broadcast:LAST", rrdpath.c_str());
-   params[11] = temp.clone();
+   params.insert(params.end(), {
+      "LINE1:bc#B8B8B8",
+      "LINE1:mv#000000",
+      "GPRINT:bc:LAST:Last bps value\\: %8.2lf %s",
+      "GPRINT:mv:LAST:Moving average (1Hr)\\: %8.2lf %s"
+   });
 
-   temp.print("DEF:mv=%s:maverage:LAST", rrdpath.c_str());
-   params[12] = temp.clone();
+   // librrd is free to shuffle and modify argv, so it gets pointers to our own copies.
+   std::vector<char *> argv;
+   for (auto &it : params) argv.push_back(&it[0]);
+   argv.push_back(nullptr);
 
-   char **calcpr {};
-   int result;
-   double ymin, ymax;
+   std::shared_ptr<std::string> png;
+   {
+      std::lock_guard<std::mutex> lock {liblock};
+      optind = opterr = 0;
+      rrd_info_t *info = rrd_graph_v(argv.size() - 1, argv.data());
 
-   optind = opterr = 0;
-   result = rrd_graph(17, const_cast<char **>(params), &calcpr, &xsize, &ysize, nullptr, &ymin, &ymax);
+      for (rrd_info_t *it = info; it; it = it->next)
+      {
+         if (RD_I_BLO != it->type or 0 != strcmp("image", it->key)) continue;
+         png = std::make_shared<std::string>(reinterpret_cast<const char *>(it->value.u_blo.ptr), it->value.u_blo.size);
+         break;
+      }
 
-   if (calcpr) { for (unsigned int i = 0; (calcpr[i]); i++) free(calcpr[i]); }
-   for (unsigned i = 0; i < psize; i++) delete [] params[i];
-   delete [] params;
+      rrd_info_free(info);
+      if (storage_type::ring == storage) ::remove(source.c_str());
 
-   if (rrd_test_error() or 0 != result)
-      throw logging::error {funcname, "RRD Graph failed: %s", rrd_get_error()};
+      if (rrd_test_error() or nullptr == png)
+         throw logging::error {funcname, "RRD Graph failed: %s", rrd_get_error()};
+   }
+
+   std::lock_guard<std::mutex> lock {cachelock};
+   // Renders from previous steps are outdated anyway.
+   for (auto it = graph_cache.begin(); it != graph_cache.end();)
+   {
+      if (it->first.second < key.second) it = graph_cache.erase(it);
+      else ++it;
+   }
+
+   graph_cache.emplace(key, png);
+   return png;
 }
@@ -1,27 +1,45 @@
 #ifndef LOOPD_RRD_H
 #define LOOPD_RRD_H
 
+#include <memory>
 #include <string>
 
+#include "ring_store.h"
+
+enum class storage_type
+{
+   rrd,     // Every sample goes straight to librrd.
+   ring     // Samples go to memory-mapped ring file of the device, RRD is built from it only for graphs.
+};
+
 class rrd
 {
    public:
-      void init(const char *rrdpath, unsigned step);
+      // Interface's data in device's data directory.
+      void init(const std::string &devdir, unsigned id, unsigned step);
       void remove();
 
-      void graph(const char *filename, const char *title, int xsize = 500, int ysize = 120);
+      // Returns PNG image. Renders are cached, so the same graph is drawn once per step.
+      std::shared_ptr<const std::string> graph(const char *title, int xsize = 500, int ysize = 120);
       void add_data(double val, double mav);
 
+      // Should be set before any RRD set is initialized.
+      static void set_storage(storage_type type) { storage = type; }
+
    private:
-      void create();
+      void create(const char *path, time_t start);
+      void export_rrd(const std::string &path);
 
       bool valid {false};
       std::string rrdpath;
       unsigned step;
 
+      // Ring storage is shared by copies, device data is copied for updater thread.
+      std::shared_ptr<ring_store> ring;
+
+      static storage_type storage;
+
       static const char *create_params[];
-      static const char *update_params[];
-      static const char *graph_params[];
 };
 
 #endif
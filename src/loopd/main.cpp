@@ -1,11 +1,16 @@
+#include <algorithm>
 #include <chrono>
 #include <cmath>
 
-#include "snmp/mux_poller.h"
+#include <curl/curl.h>
+
+#include "snmp/sharded_poller.h"
 #include "aux_log.h"
 #include "prog_config.h"
 
 #include "data.h"
+#include "metrics.h"
+#include "snapshot.h"
 #include "worker.h"
 
 using std::chrono::steady_clock;
@@ -24,6 +29,7 @@ namespace {
       { "update-interval",  { conf::val_type::integer } },
       { "poll-interval",    { conf::val_type::integer } },
       { "recheck-interval", { conf::val_type::integer } },
+      { "poll-slots",       { conf::val_type::integer, 10 } },
 
       { "bcmax",         { conf::val_type::integer } },
       { "mavlow",        { conf::val_type::integer } },
@@ -36,11 +42,38 @@ namespace {
       { "image-height", { conf::val_type::integer } },
       { "from",         { conf::val_type::string  } },
       { "rcpts",        { conf::val_type::multistring } },
-      { "smtphost",     { conf::val_type::string } }
+      { "smtphost",     { conf::val_type::string } },
+      { "notify-threads", { conf::val_type::integer, 4 } }
    };
 
    conf::config_map snmp_section {
-      { "default-community", { conf::val_type::string } }
+      { "default-community", { conf::val_type::string } },
+      { "poll-method",       { conf::val_type::string, "select" } },
+      { "max-hosts",         { conf::val_type::integer, 512 } },
+      { "update-hosts",      { conf::val_type::integer, 64 } },
+      { "shared-sockets",    { conf::val_type::integer, 1 } },
+      { "keep-sessions",     { conf::val_type::integer, 0 } },
+      { "shards",            { conf::val_type::integer, 1 } },
+      { "max-pps",           { conf::val_type::integer, 0 } },
+      { "subnet-inflight",   { conf::val_type::integer, 0 } },
+      { "subnet-prefix",     { conf::val_type::integer, 24 } }
+   };
+
+   // Shard of the device set polled by this instance, 1 to 'shards'. Every instance must have
+   // the same 'shards' and 'vnodes', otherwise some devices are polled twice and some never.
+   conf::config_map sharding_section {
+      { "shard",  { conf::val_type::integer, 1 } },
+      { "shards", { conf::val_type::integer, 1 } },
+      { "vnodes", { conf::val_type::integer, 128 } }
+   };
+
+   // Empty socket path or zabbix-server disable the corresponding output.
+   conf::config_map metrics_section {
+      { "socket",        { conf::val_type::string, "" } },
+      { "zabbix-server", { conf::val_type::string, "" } },
+      { "zabbix-port",   { conf::val_type::integer, 10051 } },
+      { "zabbix-host",   { conf::val_type::string, "loopd" } },
+      { "push-interval", { conf::val_type::integer, 60 } }
    };
 }
 
@@ -51,119 +84,391 @@ conf::config_map config {
    { "snmp",      { conf::val_type::section, &snmp_section   } },
    { "poller",    { conf::val_type::section, &poller_section } },
    { "notifier",  { conf::val_type::section, &notif_section  } },
+   { "metrics",   { conf::val_type::section, &metrics_section } },
+   { "sharding",  { conf::val_type::section, &sharding_section } },
 
    { "datadir",   { conf::val_type::string      } }, 
+   { "storage",   { conf::val_type::string, "rrd" } },
+   // Seconds between state snapshots. Zero means default, snapshots are disabled by a negative value.
+   { "snapshot-interval", { conf::val_type::integer, 300 } },
    { "devgroups", { conf::val_type::multistring } },
 };
 
 devsdata devices;
-devtasks action_data, action_queue, return_data;
-inttasks alarm_data, alarm_queue;
+mpsc_queue<device *> action_queue;
+inttasks alarm_queue;
 
-snmp::mux_poller poller;
+// Device tasks which didn't fit into worker's ring yet. Main thread only.
+devtasks action_backlog;
+
+snmp::sharded_poller poller;
 thread_sync syncdata;
 
-void transfer_data(devsdata &maind, devsdata &repld)
+// Devices which are changed or removed while worker still holds references to them.
+std::vector<device *> deferred;
+
+// Updater thread works on a light copy of devices: identity and interface names only, no polling history.
+// Devices held by worker are not walked again, worker is going to do that anyway. Worker changes their
+// state, community and interfaces, so only fields which never change (host, name, path) are copied,
+// and their updates are always deferred (see apply_update).
+devsdata * snapshot_devices(const devsdata &maind)
+{
+   devsdata *snap = new devsdata;
+
+   for (auto &it : maind)
+   {
+      const device &dev = it.second;
+      if (dev.dropped) continue;
+
+      bool held {0 != dev.worker_refs};
+      device &copy = snap->emplace(std::piecewise_construct, std::forward_as_tuple(it.first),
+            std::forward_as_tuple(dev.host, dev.name, held ? std::string {} : dev.community, dev.rrdpath)).first->second;
+
+      if (held or hoststate::enabled != dev.state) { copy.state = hoststate::unreachable; continue; }
+
+      copy.state = dev.state;
+      copy.objid = dev.objid;
+      copy.objid_raw = dev.objid_raw;
+      copy.rtt = dev.rtt;
+
+      for (auto &intf : dev.ints)
+      {
+         int_info &cint = copy.ints[intf.first];
+         cint.id = intf.second.id;
+         cint.name = intf.second.name;
+         cint.alias = intf.second.alias;
+         cint.rrdata = intf.second.rrdata;
+      }
+   }
+
+   return snap;
+}
+
+void hand_over(device &dev)
 {
-   static const char *funcname {"transfer_data"};
-   std::swap(maind, repld);
+   dev.worker_refs++;
+   action_queue.push(&dev);
+}
 
-   std::vector<unsigned> intdel;
-   std::vector<std::string> devdel;
+void add_device(devsdata &maind, device &upd)
+{
+   device &dev = maind.emplace(std::piecewise_construct, std::forward_as_tuple(upd.host),
+         std::forward_as_tuple(upd.host, upd.name, upd.community, upd.rrdpath)).first->second;
 
-   devsdata::iterator devit;
-   intsdata::iterator intit;
+   dev.objid = upd.objid;
+   dev.objid_raw = upd.objid_raw;
+   dev.state = upd.state;
+   dev.rtt = upd.rtt;
+   for (auto &it : upd.ints) if (!it.second.delmark) dev.ints.emplace(it.first, std::move(it.second));
 
-   for (auto &device : maind)
+   if (hoststate::enabled != dev.state) { hand_over(dev); return; }
+
+   prepare_request(dev);
+   poller.add(dev.host.c_str(), dev.community.c_str(), dev.generic_req, callback, static_cast<void *>(&dev));
+}
+
+void remove_device(devsdata &maind, device &dev)
+{
+   static const char *funcname {"remove_device"};
+
+   for (auto &it : dev.ints) it.second.rrdata.remove();
+   remove(dev.rrdpath.c_str());
+
+   logger.log_message(LOG_INFO, funcname, "%s: deleted marked device", dev.host.c_str());
+   maind.erase(dev.host);
+}
+
+device_update * make_update(device &upd)
+{
+   device_update *result = new device_update;
+
+   result->name = upd.name;
+   result->community = upd.community;
+   result->walked = (hoststate::enabled == upd.state);
+   if (!result->walked) return result;
+
+   for (auto &it : upd.ints) if (!it.second.delmark) result->ints.emplace(it.first, std::move(it.second));
+   return result;
+}
+
+bool differs(const device &dev, const device_update &upd)
+{
+   if (dev.name != upd.name or dev.community != upd.community) return true;
+   if (!upd.walked) return false;
+   if (dev.ints.size() != upd.ints.size()) return true;
+
+   for (auto &it : upd.ints)
    {
-      if  (device.second.delmark)
+      intsdata::const_iterator intit = dev.ints.find(it.first);
+      if (dev.ints.end() == intit or intit->second.alias != it.second.alias) return true;
+   }
+
+   return false;
+}
+
+// Applies update in place. Poller's task is rebuilt only if request has changed.
+void apply_changes(device &dev, device_update &upd)
+{
+   static const char *funcname {"apply_changes"};
+   bool rebuild {dev.community != upd.community};
+
+   dev.name = upd.name;
+   dev.community = upd.community;
+
+   if (upd.walked)
+   {
+      std::vector<unsigned> intdel;
+      for (auto &intf : dev.ints)
+      {
+         if (upd.ints.end() != upd.ints.find(intf.first)) continue;
+         intf.second.rrdata.remove();
+         intdel.push_back(intf.first);
+      }
+
+      for (auto n : intdel)
+      {
+         logger.log_message(LOG_INFO, funcname, "%s: deleted marked interface %u", dev.host.c_str(), n);
+         dev.ints.erase(n);
+      }
+
+      for (auto &it : upd.ints)
+      {
+         intsdata::iterator intit = dev.ints.find(it.first);
+         if (dev.ints.end() != intit) { intit->second.alias = it.second.alias; continue; }
+         dev.ints.emplace(it.first, std::move(it.second));
+         rebuild = true;
+      }
+
+      rebuild = rebuild or !intdel.empty();
+   }
+
+   if (!rebuild or hoststate::enabled != dev.state) return;
+
+   poller.erase(dev.host.c_str());
+   prepare_request(dev);
+   poller.add(dev.host.c_str(), dev.community.c_str(), dev.generic_req, callback, static_cast<void *>(&dev));
+}
+
+void defer(device &dev)
+{
+   if (!dev.pending and !dev.dropped) deferred.push_back(&dev);
+}
+
+// Applies updater's results to the working set. Unchanged devices are not touched at all. Devices held
+// by worker are changed or deleted later (see apply_deferred).
+void apply_update(devsdata &maind, devsdata &snap)
+{
+   static const char *funcname {"apply_update"};
+   unsigned added {}, removed {}, changed {};
+
+   for (auto &it : snap)
+   {
+      device &upd = it.second;
+      devsdata::iterator devit = maind.find(it.first);
+
+      if (maind.end() == devit)
       {
-         for (auto &ints : device.second.ints) ints.second.rrdata.remove();
-         remove(device.second.rrdpath.c_str());
-         devdel.push_back(device.first);
+         if (upd.delmark) continue;
+         add_device(maind, upd);
+         added++;
          continue;
       }
 
-      intdel.clear();
-      for (auto &intf : device.second.ints)
+      device &dev = devit->second;
+      // Device is still waiting for worker to release it. It will be added again on the next update.
+      if (dev.dropped) continue;
+
+      if (upd.delmark)
       {
-         if (intf.second.delmark)
-         {
-            intf.second.rrdata.remove();
-            intdel.push_back(intf.first);
-            continue;
-         }
-
-         if (repld.end() != (devit = repld.find(device.first)) and
-             devit->second.ints.end() != (intit = devit->second.ints.find(intf.first))) 
-            intf.second.data = intit->second.data;
+         defer(dev);
+         dev.dropped = true;
+         dev.pending.reset();
+         poller.erase(dev.host.c_str());
+         removed++;
+         continue;
       }
 
-      for (auto n : intdel)
+      std::unique_ptr<device_update> changes {make_update(upd)};
+
+      // Device can't be even compared while worker holds it, so changes are checked once it's released.
+      if (0 != dev.worker_refs)
       {
-         logger.log_message(LOG_INFO, funcname, "%s: deleted marked interface %u",
-               device.first.c_str(), n);
-         device.second.ints.erase(n);
+         defer(dev);
+         dev.pending = std::move(changes);
+         continue;
       }
 
-      if (hoststate::enabled == device.second.state) prepare_request(device.second);
+      if (!differs(dev, *changes)) continue;
+      apply_changes(dev, *changes);
+      changed++;
    }
 
-   for (auto n : devdel) 
+   if (0 != removed) syncdata.purge = true;
+   logger.log_message(LOG_INFO, funcname, "devices added: %u, removed: %u, changed: %u, deferred: %lu",
+         added, removed, changed, deferred.size());
+}
+
+void apply_deferred(devsdata &maind)
+{
+   std::vector<device *> waiting;
+
+   for (auto dev : deferred)
    {
-      logger.log_message(LOG_INFO, funcname, "%s: deleted marked device", n.c_str());
-      maind.erase(n);
-   }   
+      if (0 != dev->worker_refs) { waiting.push_back(dev); continue; }
+      if (dev->dropped) { remove_device(maind, *dev); continue; }
+
+      if (differs(*dev, *dev->pending)) apply_changes(*dev, *dev->pending);
+      dev->pending.reset();
+   }
+
+   deferred.swap(waiting);
+}
+
+void wake_worker()
+{
+   syncdata.wake.notify();
+}
+
+// Hands queued jobs over to worker. Whatever doesn't fit into the rings is kept for the next round,
+// so main thread never waits for worker.
+void add_jobs()
+{
+   action_queue.consume([](device *dev) {
+         poller.erase(dev->host.c_str());
+         action_backlog.push_back(dev);
+      });
+
+   size_t actions {}, alarms {};
+   while (actions < action_backlog.size() and syncdata.actions.push(action_backlog[actions])) actions++;
+   while (alarms < alarm_queue.size() and syncdata.alarms.push(alarm_queue[alarms])) alarms++;
+
+   action_backlog.erase(action_backlog.begin(), action_backlog.begin() + actions);
+   alarm_queue.erase(alarm_queue.begin(), alarm_queue.begin() + alarms);
+   if (0 != actions or 0 != alarms) wake_worker();
+
+   metrics.action_queue = action_backlog.size() + syncdata.actions.size();
+   metrics.alarm_queue = alarm_queue.size() + syncdata.alarms.size();
+}
+
+void setup_poller()
+{
+   poller.set_shards(config["snmp"]["shards"].get<conf::integer_t>());
+   poller.set_method(configured_poll_method());
+
+   poller.set_max_hosts(config["snmp"]["max-hosts"].get<conf::integer_t>());
+   poller.set_shared_sockets(config["snmp"]["shared-sockets"].get<conf::integer_t>());
+   poller.set_session_cache(0 != config["snmp"]["keep-sessions"].get<conf::integer_t>());
+   poller.set_pacing(config["snmp"]["max-pps"].get<conf::integer_t>(),
+         config["snmp"]["subnet-inflight"].get<conf::integer_t>(), config["snmp"]["subnet-prefix"].get<conf::integer_t>());
+}
+
+void setup_metrics()
+{
+   const conf::config_entry &section {config["metrics"]};
+
+   start_metrics(section["socket"].get<conf::string_t>(), section["zabbix-server"].get<conf::string_t>(),
+         section["zabbix-port"].get<conf::integer_t>(), section["zabbix-host"].get<conf::string_t>(),
+         section["push-interval"].get<conf::integer_t>());
+}
+
+void setup_sharding()
+{
+   static const char *funcname {"setup_sharding"};
+   const conf::integer_t shard {config["sharding"]["shard"].get<conf::integer_t>()};
+   const conf::integer_t shards {config["sharding"]["shards"].get<conf::integer_t>()};
+   const conf::integer_t vnodes {config["sharding"]["vnodes"].get<conf::integer_t>()};
+
+   if (shards < 1 or shard < 1 or shard > shards)
+      throw logging::error {funcname, "invalid shard %d of %d", shard, shards};
+   if (vnodes < 1) throw logging::error {funcname, "invalid number of virtual nodes: %d", vnodes};
+
+   set_sharding(shard - 1, shards, vnodes);
+   if (1 < shards) logger.log_message(LOG_INFO, funcname, "polling shard %d of %d", shard, shards);
 }
 
-void prepare_data(devsdata &maind, devsdata &newd, std::thread &worker_thread)
+void setup_storage()
 {
-   // Waiting for worker thread to finish his current jobs and exit. Worker should complete all his alarm
-   // notification jobs before exiting. All data has to be rebuilt because all pointers will be invalidated
-   // after dataswap.
-   if (worker_thread.joinable())
+   static const char *funcname {"setup_storage"};
+   const conf::string_t &storage {config["storage"].get<conf::string_t>()};
+
+   if ("rrd" == storage) rrd::set_storage(storage_type::rrd);
+   else if ("ring" == storage) rrd::set_storage(storage_type::ring);
+   else throw logging::error {funcname, "unknown storage: '%s'", storage.c_str()};
+}
+
+const std::string & snapshot_path()
+{
+   static const std::string path {config["datadir"].get<conf::string_t>() + "/loopd.state"};
+   return path;
+}
+
+// Devices from the last snapshot are polled right away, device update runs in background as usual.
+void restore_devices()
+{
+   static const char *funcname {"restore_devices"};
+   static const conf::integer_t interval {config["poller"]["poll-interval"].get<conf::integer_t>()};
+
+   try { load_snapshot(devices, snapshot_path(), interval, 3600 / interval); }
+   catch (std::exception &exc)
    {
-      syncdata.statelock.lock();
-      syncdata.running = false;
+      logger.log_message(LOG_ERR, funcname, "state snapshot is ignored: %s", exc.what());
+      devices.clear();
+      return;
+   }
 
-      if (syncdata.sleeping) { syncdata.sleeping = false; syncdata.wake.notify_all(); }
-      syncdata.statelock.unlock();
-      worker_thread.join();
+   // Snapshot could be saved with different sharding settings.
+   for (devsdata::iterator it = devices.begin(); it != devices.end();)
+      if (in_shard(it->first)) ++it;
+      else it = devices.erase(it);
+
+   for (auto &it : devices)
+   {
+      prepare_request(it.second);
+      poller.add(it.first.c_str(), it.second.community.c_str(), it.second.generic_req, callback, static_cast<void *>(&(it.second)));
    }
 
-   transfer_data(maind, newd);
-   action_data.clear();
-   poller.clear();
+   logger.log_message(LOG_INFO, funcname, "restored %lu devices from state snapshot", devices.size());
+}
+
+// Set while snapshot is being written by its thread.
+std::atomic<bool> snapshot_writing {false};
 
-   for (auto &device : devices)
+void write_devices(std::string image, steady_clock::time_point start)
+{
+   static const char *funcname {"write_devices"};
+
+   try { write_snapshot(image, snapshot_path()); }
+   catch (std::exception &exc)
    {
-      if (hoststate::enabled != device.second.state) action_data.push_back(&(device.second));
-      else poller.add(device.first.c_str(), device.second.community.c_str(),
-               device.second.generic_req, callback, static_cast<void *>(&(device.second)));
+      logger.log_message(LOG_ERR, funcname, "failed to save state snapshot: %s", exc.what());
+      snapshot_writing = false;
+      return;
    }
 
-   syncdata.running = true;
-   worker_thread = std::thread{worker, &syncdata};
+   logger.log_message(LOG_INFO, funcname, "state snapshot saved in %fs",
+         std::chrono::duration<double>(steady_clock::now() - start).count());
+   snapshot_writing = false;
 }
 
-void add_jobs()
+// Only the in-memory image is built within the slot, file is written and synced by a separate thread.
+// Snapshot is skipped if the previous one is still being written.
+void save_devices()
 {
-   syncdata.worker_datalock.lock();
-   for (auto &entry : alarm_queue) alarm_data.push_back(entry);
+   static const char *funcname {"save_devices"};
 
-   for (auto &entry : action_queue)
+   if (snapshot_writing)
    {
-      poller.erase(entry->host.c_str());
-      action_data.push_back(entry);
+      logger.log_message(LOG_WARNING, funcname, "previous state snapshot is still being written, skipped");
+      return;
    }
 
-   alarm_queue.clear();
-   action_queue.clear();
-   syncdata.worker_datalock.unlock();
+   steady_clock::time_point start {steady_clock::now()};
+   std::string image {make_snapshot(devices)};
+   logger.log_message(LOG_INFO, funcname, "state snapshot of %lu bytes built in %fs", image.size(),
+         std::chrono::duration<double>(steady_clock::now() - start).count());
 
-   syncdata.statelock.lock();
-   if (syncdata.sleeping) { syncdata.sleeping = false; syncdata.wake.notify_all(); }
-   syncdata.statelock.unlock();
+   snapshot_writing = true;
+   std::thread {write_devices, std::move(image), start}.detach();
 }
 
 void mainloop()
@@ -175,7 +480,23 @@ void mainloop()
    const std::chrono::hours update_interval {config["poller"]["update-interval"].get<conf::integer_t>()};
    const std::chrono::seconds poll_interval {config["poller"]["poll-interval"].get<conf::integer_t>()};
 
-   std::thread worker_thread;
+   // Devices are spread over time slots within the interval, every slot is polled at its own deadline.
+   // Deadlines are kept on an absolute timeline, so rounds don't drift with their own duration.
+   const unsigned nslots = std::max<conf::integer_t>(1, std::min<conf::integer_t>(
+            config["poller"]["poll-slots"].get<conf::integer_t>(), poll_interval.count()));
+   // Divided in clock ticks, whole seconds would make rounds shorter than the interval.
+   const steady_clock::duration slot_time {std::chrono::duration_cast<steady_clock::duration>(poll_interval) / nslots};
+   steady_clock::time_point deadline {steady_clock::now()}, now;
+   unsigned slot {};
+
+   // Round metrics. Round duration is the time spent in its slots, without sleeping between them,
+   // so it shows how close polling is to overrunning the interval. PDUs are answers plus timeouts.
+   steady_clock::time_point round_start {deadline};
+   std::chrono::duration<double> round_busy {};
+   uint64_t round_pdus {};
+
+   // Worker is never stopped, device updates are applied in place.
+   std::thread {worker, &syncdata}.detach();
 
    // Data to synchronize with updater thread.
    bool update_started {false};
@@ -183,55 +504,97 @@ void mainloop()
    devsdata *newdata {};
 
    steady_clock::time_point begin, last_update {steady_clock::now()};
-   std::unique_lock<std::mutex> datalock {syncdata.device_datalock, std::defer_lock};
    std::chrono::hours since_update;
+   bool first_update {true};
+
+   const std::chrono::seconds snapshot_interval {config["snapshot-interval"].get<conf::integer_t>()};
+   steady_clock::time_point last_snapshot {steady_clock::now()};
+
+   // Snapshot left from the time they were enabled would be outdated.
+   if (0 < snapshot_interval.count()) restore_devices();
 
    for (;;)
    {
       begin = steady_clock::now();
-      datalock.lock();
-      poller.poll();
-      datalock.unlock();
+      if (0 == slot) round_start = begin;
+
+      poller.poll(slot, nslots);
+      detect_alarms();
+      metrics.slot_duration.observe(std::chrono::duration<double>(steady_clock::now() - begin).count());
+
+      // Devices which are active again. Worker's reference comes with the device and is released here,
+      // so a dropped device is never deleted while it's still in the ring.
+      bool returned {false};
+      for (device *dev; syncdata.returns.pop(dev); returned = true)
+      {
+         dev->worker_refs--;
+         if (dev->dropped) continue;
+         poller.add(dev->host.c_str(), dev->community.c_str(), dev->generic_req, callback, static_cast<void *>(dev));
+      }
+      if (returned) syncdata.returns_drained.notify();
+
+      add_jobs();
 
       if (update_started and not updating)
       {
-         logger.log_message(LOG_INFO, funcname, "device update finished. swapping data %lu -> %lu",
+         logger.log_message(LOG_INFO, funcname, "device update finished. applying data %lu -> %lu",
                newdata->size(), devices.size());
          update_started = false;
 
-         prepare_data(devices, *newdata, worker_thread);
+         apply_update(devices, *newdata);
          delete newdata;
+         wake_worker();
       }
 
+      if (!deferred.empty()) apply_deferred(devices);
+
       since_update = std::chrono::duration_cast<std::chrono::hours>(begin - last_update);      
-      if (not updating and (devices.empty() or update_interval <= since_update))
+      if (not updating and (first_update or devices.empty() or update_interval <= since_update))
       {
-         datalock.lock();
+         first_update = false;
          update_started = updating = true;
-         newdata = new devsdata(devices);
-         datalock.unlock();
+         newdata = snapshot_devices(devices);
 
          std::thread {update_devices, newdata, std::ref(updating)}.detach();
          last_update = steady_clock::now();
       }
 
-      // Checking updates from worker thread.
-      syncdata.updatelock.lock();
-      if (syncdata.data_updated) 
+      slot = (slot + 1) % nslots;
+      deadline += slot_time;
+      now = steady_clock::now();
+      round_busy += now - begin;
+
+      if (0 == slot)
+      {
+         std::chrono::duration<double> round {now - round_start};
+         uint64_t pdus {metrics.answers + metrics.timeouts};
+
+         metrics.round_duration.observe(round_busy.count());
+         if (0 < round.count()) metrics.pdus_per_second = (pdus - round_pdus) / round.count();
+         metrics.devices = devices.size();
+         round_busy = round_busy.zero();
+         round_pdus = pdus;
+      }
+
+      // Slightly late slot is started at once and timeline catches up. If we're behind by more than a slot,
+      // timeline is moved instead, catching up would only make a burst of rounds.
+      if (now > deadline)
       {
-         for (auto it : return_data)
-            poller.add(it->host.c_str(), it->community.c_str(),
-                  it->generic_req, callback, static_cast<void *>(it));
+         std::chrono::duration<double> late {now - deadline};
+         logger.log_message(LOG_WARNING, funcname, "polling overrun: slot %u is late by %fs", slot, late.count());
+         metrics.overruns++;
+         if (now - deadline > slot_time) deadline = now;
+      }
 
-         syncdata.data_updated = false;
-         return_data.clear();
+      if (0 == slot and 0 < snapshot_interval.count() and snapshot_interval <= now - last_snapshot)
+      {
+         save_devices();
+         last_snapshot = now = steady_clock::now();
       }
-      syncdata.updatelock.unlock();
 
-      if (!action_queue.empty() or !alarm_queue.empty()) add_jobs();
-      logger.log_message(LOG_INFO, funcname, "sleeping for %lds", 
-            (poll_interval - std::chrono::duration_cast<std::chrono::seconds>(steady_clock::now() - begin)).count());
-      std::this_thread::sleep_for(poll_interval - std::chrono::duration_cast<std::chrono::seconds>(steady_clock::now() - begin));
+      if (0 == slot) logger.log_message(LOG_INFO, funcname, "round finished, next round in %fs",
+            std::chrono::duration<double>(deadline - now).count());
+      std::this_thread::sleep_until(deadline);
    }
 }
 
@@ -240,6 +603,9 @@ int main()
    std::setlocale(LC_ALL, "en_US.UTF-8");
    logger.method = logging::log_method::M_STDE;
 
+   // Notifier threads and updater create curl handles concurrently, so global init can't be left to libcurl.
+   curl_global_init(CURL_GLOBAL_ALL);
+
    try {
       if (0 == conf::read_config(conffile, config))
          logger.error_exit(progname, "Errors while reading configuration file.");
@@ -247,6 +613,10 @@ int main()
       init_snmp(progname);
       netsnmp_ds_set_int(NETSNMP_DS_LIBRARY_ID, NETSNMP_DS_LIB_OID_OUTPUT_FORMAT, NETSNMP_OID_OUTPUT_NUMERIC);
 
+      setup_poller();
+      setup_storage();
+      setup_sharding();
+      setup_metrics();
       mainloop();
    }
 
@@ -0,0 +1,58 @@
+#ifndef LOOPD_MAVWINDOW_H
+#define LOOPD_MAVWINDOW_H
+
+#include <cstddef>
+#include <vector>
+
+// Fixed-size window of the latest samples with a running sum, so moving average is O(1) per sample.
+// Sum is kept with compensated (Kahan) summation, otherwise it slowly drifts away after millions
+// of add/remove pairs. Storage is a single contiguous block, allocated on the first push, so
+// interfaces which are never polled cost nothing.
+class mav_window
+{
+   public:
+      // Capacity is expected to be the same on every call.
+      void push(double value, size_t capacity)
+      {
+         if (values.empty()) values.resize(capacity);
+
+         if (count == values.size()) add(-values[head]);
+         else count++;
+
+         values[head] = value;
+         head = (head + 1) % values.size();
+         add(value);
+      }
+
+      // Storage is kept for the next samples.
+      void clear() { head = count = 0; sum = comp = 0; }
+
+      size_t size() const { return count; }
+      double mean() const { return (0 == count) ? 0 : sum / count; }
+
+      // Samples starting from the oldest one. Window is restored by pushing them back in the same order.
+      std::vector<double> samples() const
+      {
+         std::vector<double> result;
+         result.reserve(count);
+         for (size_t i = values.size() - count; i < values.size(); i++) result.push_back(values[(head + i) % values.size()]);
+         return result;
+      }
+
+   private:
+      std::vector<double> values;
+      size_t head {};
+      size_t count {};
+      double sum {};
+      double comp {};
+
+      void add(double value)
+      {
+         double y = value - comp;
+         double t = sum + y;
+         comp = (t - sum) - y;
+         sum = t;
+      }
+};
+
+#endif
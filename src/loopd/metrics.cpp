@@ -0,0 +1,248 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "aux_log.h"
+#include "zbx_sender.h"
+#include "metrics.h"
+
+loopd_metrics metrics;
+
+histogram::histogram(std::initializer_list<double> bounds_) :
+   bounds{bounds_}, buckets{new std::atomic<uint64_t>[bounds_.size() + 1]}
+{
+   for (size_t i = 0; i <= bounds.size(); i++) buckets[i] = 0;
+}
+
+void histogram::observe(double seconds)
+{
+   size_t i = 0;
+   while (i < bounds.size() and seconds > bounds[i]) i++;
+
+   buckets[i]++;
+   sum_us += static_cast<uint64_t>(std::max(0.0, seconds) * 1e6);
+   total++;
+}
+
+void histogram::print(buffer &out, const char *name, const char *help) const
+{
+   uint64_t cumulative {};
+
+   out.append("# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+   for (size_t i = 0; i < bounds.size(); i++)
+   {
+      cumulative += buckets[i];
+      out.append("%s_bucket{le=\"%g\"} %lu\n", name, bounds[i], cumulative);
+   }
+
+   cumulative += buckets[bounds.size()];
+   out.append("%s_bucket{le=\"+Inf\"} %lu\n%s_sum %f\n%s_count %lu\n", name, cumulative, name, sum(), name,
+         static_cast<uint64_t>(total));
+}
+
+namespace {
+   struct zabbix_target
+   {
+      std::string server;
+      unsigned port;
+      std::string host;
+      std::chrono::seconds interval;
+   };
+
+   void print_value(buffer &out, const char *name, const char *type, const char *help, double value)
+   {
+      out.append("# HELP %s %s\n# TYPE %s %s\n%s %g\n", name, help, name, type, name, value);
+   }
+
+   void print_metrics(buffer &out)
+   {
+      out.clear();
+      metrics.round_duration.print(out, "loopd_round_duration_seconds", "Time spent in all slots of a round, sleeps excluded.");
+      metrics.slot_duration.print(out, "loopd_slot_duration_seconds", "Time spent polling a slot and checking it for alarms.");
+      metrics.host_rtt.print(out, "loopd_host_rtt_seconds", "Smoothed RTT of a host, sampled on every answer.");
+      metrics.rrd_write.print(out, "loopd_rrd_write_seconds", "Latency of a single storage write: RRD file update or ring append.");
+      metrics.updater_duration.print(out, "loopd_updater_duration_seconds", "Duration of a device update.");
+
+      print_value(out, "loopd_answers_total", "counter", "Answered requests.", metrics.answers);
+      print_value(out, "loopd_timeouts_total", "counter", "Requests left without an answer.", metrics.timeouts);
+      print_value(out, "loopd_overruns_total", "counter", "Slots started after their deadline.", metrics.overruns);
+      print_value(out, "loopd_alarms_total", "counter", "Detected alarms.", metrics.alarms);
+      print_value(out, "loopd_rrd_samples_total", "counter", "Samples written to storage.", metrics.rrd_samples);
+      print_value(out, "loopd_rrd_errors_total", "counter", "Failed RRD updates.", metrics.rrd_errors);
+
+      print_value(out, "loopd_pdus_per_second", "gauge", "Answered and timed out requests per second over the last round.",
+            metrics.pdus_per_second);
+      print_value(out, "loopd_alarm_queue_depth", "gauge", "Alarms waiting for worker.", metrics.alarm_queue);
+      print_value(out, "loopd_action_queue_depth", "gauge", "Device jobs waiting for worker.", metrics.action_queue);
+      print_value(out, "loopd_devices", "gauge", "Polled devices.", metrics.devices);
+   }
+
+   int open_socket(const std::string &path)
+   {
+      static const char *funcname {"open_socket"};
+      sockaddr_un addr;
+
+      if (path.size() >= sizeof(addr.sun_path))
+         throw logging::error {funcname, "metrics socket path is too long: '%s'", path.c_str()};
+
+      memset(&addr, 0, sizeof(addr));
+      addr.sun_family = AF_UNIX;
+      strcpy(addr.sun_path, path.c_str());
+
+      int sd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      if (-1 == sd) throw logging::error {funcname, "socket() failed: %s", strerror(errno)};
+
+      // Socket left by the previous run.
+      unlink(path.c_str());
+      if (-1 == bind(sd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) or -1 == listen(sd, 8))
+      {
+         close(sd);
+         throw logging::error {funcname, "cannot listen on '%s': %s", path.c_str(), strerror(errno)};
+      }
+
+      return sd;
+   }
+
+   // Clients which send an HTTP request get an HTTP response, the rest get the metrics as is.
+   void serve_client(int sd, buffer &body)
+   {
+      static const timeval wait {0, 200000};
+      buffer reply;
+      char request[512];
+
+      setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &wait, sizeof(wait));
+      ssize_t len = recv(sd, request, sizeof(request), 0);
+
+      print_metrics(body);
+      if (len > 4 and 0 == memcmp(request, "GET ", 4))
+         reply.print("HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %ld\r\n\r\n",
+               body.size());
+      reply.mappend(body.data(), body.size());
+
+      for (buffer::size_type sent = 0; sent < reply.size();)
+      {
+         ssize_t n = send(sd, reply.data() + sent, reply.size() - sent, MSG_NOSIGNAL);
+         if (n <= 0) break;
+         sent += n;
+      }
+   }
+
+   // Histograms are pushed as averages over the push interval, counters and gauges as is.
+   class zabbix_pusher
+   {
+      public:
+         zabbix_pusher(const zabbix_target &target_) : target(target_) { }
+
+         void push()
+         {
+            static const char *funcname {"push_metrics"};
+
+            try {
+               zbx_sender zbxs {target.server.c_str(), target.port};
+
+               add_average(zbxs, "loopd.round.duration", metrics.round_duration, prev[0]);
+               add_average(zbxs, "loopd.slot.duration", metrics.slot_duration, prev[1]);
+               add_average(zbxs, "loopd.rtt", metrics.host_rtt, prev[2]);
+               add_average(zbxs, "loopd.rrd.write", metrics.rrd_write, prev[3]);
+               add_average(zbxs, "loopd.updater.duration", metrics.updater_duration, prev[4]);
+
+               zbxs.add_data(target.host, "loopd.answers", metrics.answers.load());
+               zbxs.add_data(target.host, "loopd.timeouts", metrics.timeouts.load());
+               zbxs.add_data(target.host, "loopd.overruns", metrics.overruns.load());
+               zbxs.add_data(target.host, "loopd.alarms", metrics.alarms.load());
+               zbxs.add_data(target.host, "loopd.rrd.errors", metrics.rrd_errors.load());
+               zbxs.add_data(target.host, "loopd.pps", metrics.pdus_per_second.load());
+               zbxs.add_data(target.host, "loopd.queue.alarms", metrics.alarm_queue.load());
+               zbxs.add_data(target.host, "loopd.queue.actions", metrics.action_queue.load());
+               zbxs.add_data(target.host, "loopd.devices", metrics.devices.load());
+
+               sender_response result {zbxs.send()};
+               if (0 != result.failed)
+                  logger.log_message(LOG_WARNING, funcname, "Zabbix sender response: Processed: %u; Failed: %u; Total: %u",
+                        result.processed, result.failed, result.total);
+            }
+
+            catch (std::exception &exc) {
+               logger.log_message(LOG_ERR, funcname, "failed to push metrics to %s: %s", target.server.c_str(), exc.what());
+            }
+         }
+
+      private:
+         struct observed
+         {
+            uint64_t count {};
+            double sum {};
+         };
+
+         const zabbix_target target;
+         observed prev[5];
+
+         void add_average(zbx_sender &zbxs, const char *key, const histogram &hist, observed &last)
+         {
+            observed now;
+            now.count = hist.count();
+            now.sum = hist.sum();
+
+            if (now.count > last.count) zbxs.add_data(target.host, key, (now.sum - last.sum) / (now.count - last.count));
+            last = now;
+         }
+   };
+
+   void metrics_server(std::string socket_path, zabbix_target target)
+   {
+      static const char *funcname {"metrics_server"};
+      using std::chrono::steady_clock;
+
+      try {
+         int sd = socket_path.empty() ? -1 : open_socket(socket_path);
+         std::unique_ptr<zabbix_pusher> pusher {target.server.empty() ? nullptr : new zabbix_pusher {target}};
+         steady_clock::time_point next_push {steady_clock::now() + target.interval};
+         buffer body;
+
+         for (;;)
+         {
+            int timeout = -1;
+            if (pusher)
+            {
+               steady_clock::time_point now {steady_clock::now()};
+               if (now >= next_push)
+               {
+                  pusher->push();
+                  next_push += target.interval;
+                  if (next_push <= now) next_push = now + target.interval;
+               }
+               timeout = std::chrono::duration_cast<std::chrono::milliseconds>(next_push - now).count();
+            }
+
+            pollfd pfd {sd, POLLIN, 0};
+            if (0 >= poll(&pfd, 1, timeout)) continue;
+
+            int client = accept4(sd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (-1 == client) continue;
+            serve_client(client, body);
+            close(client);
+         }
+      }
+
+      // Polling goes on without metrics.
+      catch (std::exception &exc) {
+         logger.log_message(LOG_ERR, funcname, "metrics are disabled: %s", exc.what());
+      }
+   }
+}
+
+void start_metrics(const std::string &socket_path, const std::string &zabbix_server, unsigned zabbix_port,
+      const std::string &zabbix_host, unsigned push_interval)
+{
+   if (socket_path.empty() and zabbix_server.empty()) return;
+
+   zabbix_target target {zabbix_server, zabbix_port, zabbix_host, std::chrono::seconds {std::max(1u, push_interval)}};
+   std::thread {metrics_server, socket_path, target}.detach();
+}
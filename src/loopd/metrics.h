@@ -0,0 +1,68 @@
+#ifndef LOOPD_METRICS_H
+#define LOOPD_METRICS_H
+
+#include <atomic>
+#include <cstdint>
+#include <initializer_list>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "buffer.h"
+
+// Histogram of durations in seconds with fixed bucket bounds. Updates are lock-free, so it is fed
+// from poller callbacks, writer and updater threads alike.
+class histogram
+{
+   public:
+      histogram(std::initializer_list<double> bounds_);
+
+      histogram(const histogram &other) = delete;
+      histogram & operator =(const histogram &other) = delete;
+
+      void observe(double seconds);
+
+      uint64_t count() const { return total; }
+      double sum() const { return sum_us / 1e6; }
+
+      // Prometheus text format, buckets are cumulative.
+      void print(buffer &out, const char *name, const char *help) const;
+
+   private:
+      std::vector<double> bounds;
+      std::unique_ptr<std::atomic<uint64_t> []> buckets;    // Not cumulative, last one is +Inf.
+      std::atomic<uint64_t> sum_us {};
+      std::atomic<uint64_t> total {};
+};
+
+// Gauges are updated by their single owner, counters may be bumped from any thread.
+struct loopd_metrics
+{
+   histogram slot_duration {0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30};
+   histogram round_duration {0.5, 1, 2.5, 5, 10, 20, 30, 45, 60, 120};
+   histogram host_rtt {0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5};
+   histogram rrd_write {0.0001, 0.0005, 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1};
+   histogram updater_duration {10, 30, 60, 120, 300, 600, 1200, 1800, 3600};
+
+   std::atomic<uint64_t> answers {};         // Answered GETs.
+   std::atomic<uint64_t> timeouts {};        // GETs without an answer after all retries.
+   std::atomic<uint64_t> overruns {};        // Slots started after their deadline.
+   std::atomic<uint64_t> alarms {};          // New alarms handed over to worker.
+   std::atomic<uint64_t> rrd_samples {};     // Written successfully, to RRD files or rings.
+   std::atomic<uint64_t> rrd_errors {};
+
+   std::atomic<double> pdus_per_second {};   // Over the last full round.
+   std::atomic<uint64_t> alarm_queue {};     // Alarms waiting for worker, including backlog.
+   std::atomic<uint64_t> action_queue {};    // Device jobs waiting for worker, including backlog.
+   std::atomic<uint64_t> devices {};
+};
+
+extern loopd_metrics metrics;
+
+// Metrics are served in Prometheus text format on a Unix socket, either as a plain dump
+// or as an HTTP response (curl --unix-socket). Optionally they are also pushed to Zabbix
+// trapper items. Runs in its own thread; does nothing if both are disabled.
+void start_metrics(const std::string &socket_path, const std::string &zabbix_server, unsigned zabbix_port,
+      const std::string &zabbix_host, unsigned push_interval);
+
+#endif
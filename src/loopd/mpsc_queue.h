@@ -0,0 +1,69 @@
+#ifndef LOOPD_MPSCQUEUE_H
+#define LOOPD_MPSCQUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+// Lock-free queue for many producers and a single consumer. Producers push onto an intrusive stack
+// with a single CAS, consumer detaches the whole stack at once and walks it in push order.
+// There is no ABA problem, since nodes are never popped one by one.
+template <typename T>
+class mpsc_queue
+{
+   public:
+      mpsc_queue() = default;
+      mpsc_queue(const mpsc_queue &other) = delete;
+      mpsc_queue & operator =(const mpsc_queue &other) = delete;
+
+      ~mpsc_queue() { consume([](T &) { }); }
+
+      void push(T &&value)
+      {
+         node *n = new node {std::move(value), head.load(std::memory_order_relaxed)};
+         while (!head.compare_exchange_weak(n->next, n, std::memory_order_release, std::memory_order_relaxed));
+      }
+
+      void push(const T &value) { push(T(value)); }
+
+      bool empty() const { return nullptr == head.load(std::memory_order_acquire); }
+
+      // Calls func(value) for everything pushed so far, oldest first. Returns number of values.
+      template <typename F>
+      size_t consume(F func)
+      {
+         node *list = head.exchange(nullptr, std::memory_order_acquire);
+         node *ordered {};
+
+         while (list)
+         {
+            node *next = list->next;
+            list->next = ordered;
+            ordered = list;
+            list = next;
+         }
+
+         size_t count {};
+         while (ordered)
+         {
+            node *next = ordered->next;
+            func(ordered->value);
+            delete ordered;
+            ordered = next;
+            count++;
+         }
+
+         return count;
+      }
+
+   private:
+      struct node
+      {
+         T value;
+         node *next;
+      };
+
+      std::atomic<node *> head {nullptr};
+};
+
+#endif
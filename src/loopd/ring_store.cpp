@@ -0,0 +1,279 @@
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <mutex>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "aux_log.h"
+#include "ring_store.h"
+
+namespace {
+   const char magic[8] {'L', 'O', 'O', 'P', 'R', 'I', 'N', 'G'};
+   const uint32_t version {2};
+   const uint32_t min_slots {8};
+
+   // File layout: header followed by slots. Every slot is a slot header and a ring of 'capacity' samples,
+   // so the file grows by appending slots and existing rings never move.
+   struct file_header
+   {
+      char magic[8];
+      uint32_t version;
+      uint32_t step;
+      uint64_t capacity;
+      uint32_t nslots;
+      uint32_t reserved;
+   };
+
+   struct slot_header
+   {
+      uint32_t id;
+      uint32_t used;
+      uint64_t head;    // Next sample to write.
+      uint64_t count;
+   };
+}
+
+// Rings of a single device. Samples are appended from poller callbacks, while updater and worker
+// add and remove interfaces and read rings for graphs, so every access is done under the lock.
+// Stores attached to every slot are counted in memory only, slot is freed by the last one of them.
+class ring_file
+{
+   public:
+      ring_file(const std::string &path_, unsigned step, uint64_t capacity);
+      ~ring_file() { munmap(base, maplen); }
+
+      ring_file(const ring_file &other) = delete;
+      ring_file & operator =(const ring_file &other) = delete;
+
+      // Files are shared by all interfaces of a device, so there is only one mapping per file.
+      static std::shared_ptr<ring_file> open(const std::string &path, unsigned step, uint64_t capacity);
+      bool is_removed() const { std::lock_guard<std::mutex> guard {lock}; return removed; }
+
+      bool attach(uint32_t id, unsigned &slot);
+      void detach(unsigned slot, bool release);
+      void append(unsigned slot, time_t ts, double bc, double mav);
+      std::vector<ring_store::sample> samples(unsigned slot) const;
+
+   private:
+      std::string path;
+      mutable std::mutex lock;
+      bool removed {false};   // File is deleted, interfaces added later need a new one.
+      char *base {};
+      size_t maplen {};
+      size_t slotlen;
+      std::vector<unsigned> refs;
+      std::vector<bool> released;
+
+      file_header * header() const { return reinterpret_cast<file_header *>(base); }
+      slot_header * slot_at(unsigned slot) const {
+         return reinterpret_cast<slot_header *>(base + sizeof(file_header) + slot * slotlen); }
+      ring_store::sample * samples_at(unsigned slot) const {
+         return reinterpret_cast<ring_store::sample *>(slot_at(slot) + 1); }
+
+      void map(uint32_t nslots);
+      void free_slot(unsigned slot);
+};
+
+ring_file::ring_file(const std::string &path_, unsigned step, uint64_t capacity) :
+   path{path_}, slotlen{sizeof(slot_header) + capacity * sizeof(ring_store::sample)}
+{
+   static const char *funcname {"ring_file::ring_file"};
+   struct stat stbuf;
+   file_header hdr;
+   uint32_t nslots {};
+
+   // Existing file is reused only if it has exactly the same layout, otherwise it's started from scratch.
+   int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+   if (-1 != fd)
+   {
+      if (0 == fstat(fd, &stbuf) and sizeof(hdr) == pread(fd, &hdr, sizeof(hdr), 0) and
+            0 == memcmp(hdr.magic, magic, sizeof(magic)) and version == hdr.version and step == hdr.step and
+            capacity == hdr.capacity and static_cast<size_t>(stbuf.st_size) == sizeof(file_header) + hdr.nslots * slotlen)
+         nslots = hdr.nslots;
+      close(fd);
+      if (0 == nslots and -1 == truncate(path.c_str(), 0))
+         throw logging::error {funcname, "failed to reset '%s': %s", path.c_str(), strerror(errno)};
+   }
+
+   map(nslots);
+   refs.resize(nslots);
+   released.resize(nslots);
+   if (0 != nslots) return;
+
+   file_header *fh = header();
+   memcpy(fh->magic, magic, sizeof(magic));
+   fh->version = version;
+   fh->step = step;
+   fh->capacity = capacity;
+   fh->nslots = 0;
+}
+
+// Maps the file with room for 'nslots' slots. New slots are zeroed by ftruncate, i.e. unused.
+// Descriptor is needed only to set up the mapping.
+void ring_file::map(uint32_t nslots)
+{
+   static const char *funcname {"ring_file::map"};
+   size_t newlen {sizeof(file_header) + nslots * slotlen};
+
+   int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+   if (-1 == fd) throw logging::error {funcname, "failed to open '%s': %s", path.c_str(), strerror(errno)};
+
+   struct stat stbuf;
+   if (-1 == fstat(fd, &stbuf) or (static_cast<size_t>(stbuf.st_size) < newlen and -1 == ftruncate(fd, newlen)))
+   {
+      close(fd);
+      throw logging::error {funcname, "failed to set up '%s': %s", path.c_str(), strerror(errno)};
+   }
+
+   void *mem = mmap(nullptr, newlen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+   if (MAP_FAILED == mem) throw logging::error {funcname, "failed to map '%s': %s", path.c_str(), strerror(errno)};
+
+   if (nullptr != base) munmap(base, maplen);
+   base = static_cast<char *>(mem);
+   maplen = newlen;
+}
+
+std::shared_ptr<ring_file> ring_file::open(const std::string &path, unsigned step, uint64_t capacity)
+{
+   static std::mutex registry_lock;
+   static std::map<std::string, std::weak_ptr<ring_file>> registry;
+
+   std::lock_guard<std::mutex> guard {registry_lock};
+   std::shared_ptr<ring_file> file {registry[path].lock()};
+   if (file and !file->is_removed()) return file;
+
+   for (auto it = registry.begin(); it != registry.end();)
+   {
+      if (it->second.expired()) it = registry.erase(it);
+      else ++it;
+   }
+
+   file = std::make_shared<ring_file>(path, step, capacity);
+   registry[path] = file;
+   return file;
+}
+
+// Fails only if the file was deleted after it had been opened.
+bool ring_file::attach(uint32_t id, unsigned &slot)
+{
+   std::lock_guard<std::mutex> guard {lock};
+   if (removed) return false;
+
+   uint32_t nslots {header()->nslots};
+   unsigned free {nslots};
+
+   for (unsigned n = 0; n < nslots; n++)
+   {
+      slot_header *sh = slot_at(n);
+      if (sh->used and id == sh->id)
+      {
+         // Ring which is being removed is brought back by the new interface with the same id.
+         refs[n]++;
+         released[n] = false;
+         slot = n;
+         return true;
+      }
+      if (!sh->used and free == nslots) free = n;
+   }
+
+   if (free == nslots)
+   {
+      uint32_t grown {std::max(min_slots, nslots * 2)};
+      map(grown);
+      header()->nslots = grown;
+      refs.resize(grown);
+      released.resize(grown);
+   }
+
+   slot_header *sh = slot_at(free);
+   sh->id = id;
+   sh->used = 1;
+   sh->head = sh->count = 0;
+   refs[free] = 1;
+   released[free] = false;
+   slot = free;
+   return true;
+}
+
+// Ring is kept on disk when its last store is gone, unless one of the stores has released it.
+void ring_file::detach(unsigned slot, bool release)
+{
+   std::lock_guard<std::mutex> guard {lock};
+   if (release) released[slot] = true;
+   if (0 == --refs[slot] and released[slot]) free_slot(slot);
+}
+
+void ring_file::free_slot(unsigned slot)
+{
+   slot_at(slot)->used = 0;
+   released[slot] = false;
+
+   for (unsigned n = 0; n < header()->nslots; n++)
+      if (slot_at(n)->used) return;
+
+   // Device has no interfaces left. Mapping stays valid until the last handle is gone.
+   ::remove(path.c_str());
+   removed = true;
+}
+
+void ring_file::append(unsigned slot, time_t ts, double bc, double mav)
+{
+   std::lock_guard<std::mutex> guard {lock};
+   uint64_t capacity {header()->capacity};
+   slot_header *sh = slot_at(slot);
+
+   samples_at(slot)[sh->head] = ring_store::sample {ts, bc, mav};
+   sh->head = (sh->head + 1) % capacity;
+   if (sh->count < capacity) sh->count++;
+}
+
+std::vector<ring_store::sample> ring_file::samples(unsigned slot) const
+{
+   std::lock_guard<std::mutex> guard {lock};
+   uint64_t capacity {header()->capacity};
+   const slot_header *sh = slot_at(slot);
+   const ring_store::sample *ring = samples_at(slot);
+
+   std::vector<ring_store::sample> result;
+   result.reserve(sh->count);
+
+   uint64_t pos = (sh->head + capacity - sh->count) % capacity;
+   for (uint64_t i = 0; i < sh->count; i++, pos = (pos + 1) % capacity) result.push_back(ring[pos]);
+   return result;
+}
+
+ring_store::ring_store(const std::string &path, uint32_t id, unsigned step, uint64_t capacity)
+{
+   // Removal of the device's last interface may delete the file right after it was opened.
+   do file = ring_file::open(path, step, capacity);
+   while (!file->attach(id, slot));
+   attached = true;
+}
+
+ring_store::~ring_store()
+{
+   if (attached) file->detach(slot, false);
+}
+
+void ring_store::append(time_t ts, double bc, double mav)
+{
+   if (attached) file->append(slot, ts, bc, mav);
+}
+
+std::vector<ring_store::sample> ring_store::samples() const
+{
+   if (!attached) return std::vector<sample> {};
+   return file->samples(slot);
+}
+
+void ring_store::remove()
+{
+   if (!attached) return;
+   attached = false;
+   file->detach(slot, true);
+}
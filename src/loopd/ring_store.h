@@ -0,0 +1,50 @@
+#ifndef LOOPD_RINGSTORE_H
+#define LOOPD_RINGSTORE_H
+
+#include <cstdint>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <vector>
+
+class ring_file;
+
+// Time series of a single interface: a ring of fixed-width samples in a memory-mapped file.
+// All interfaces of a device share one file (see ring_store.cpp), so the number of files and
+// mappings grows with devices, not interfaces. Descriptors are closed right after mapping.
+// Appending a sample is a plain memory store - no syscalls and no formatting, dirty pages
+// are written back by kernel in batches.
+class ring_store
+{
+   public:
+      struct sample
+      {
+         int64_t ts;
+         double bc;
+         double mav;
+      };
+
+      // Interface's ring is found by its id, or allocated if the file has none yet. Several stores
+      // may be attached to the same ring, e.g. while updater re-reads interfaces of a held device.
+      ring_store(const std::string &path, uint32_t id, unsigned step, uint64_t capacity);
+      ~ring_store();
+
+      ring_store(const ring_store &other) = delete;
+      ring_store & operator =(const ring_store &other) = delete;
+
+      void append(time_t ts, double bc, double mav);
+
+      // Samples from the oldest one.
+      std::vector<sample> samples() const;
+
+      // Frees interface's ring once every store attached to it is gone. File is deleted along with
+      // the last ring. Store is detached afterwards, appends are ignored and there are no samples.
+      void remove();
+
+   private:
+      std::shared_ptr<ring_file> file;
+      unsigned slot;
+      bool attached {false};
+};
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef LOOPD_SHARDRING_H
+#define LOOPD_SHARDRING_H
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Consistent hashing ring which splits devices between loopd instances. Every instance owns a number
+// of virtual nodes on the ring and a host belongs to the first node after its own position.
+// Assignment depends only on the host and the number of instances: adding devices never moves
+// other devices, and changing the number of instances moves only about 1/M of them.
+// Hashes must be the same on every box, so std::hash is not an option.
+class shard_ring
+{
+   public:
+      shard_ring(unsigned shards = 1, unsigned vnodes = 128)
+      {
+         std::string key;
+         nodes.reserve(shards * vnodes);
+
+         for (unsigned shard = 0; shard < shards; shard++)
+            for (unsigned v = 0; v < vnodes; v++)
+            {
+               key = "shard-" + std::to_string(shard) + '#' + std::to_string(v);
+               nodes.emplace_back(hash(key), shard);
+            }
+
+         std::sort(nodes.begin(), nodes.end());
+      }
+
+      // Zero-based instance which owns the host.
+      unsigned owner(const std::string &host) const
+      {
+         if (nodes.empty()) return 0;
+
+         std::vector<node>::const_iterator it = std::lower_bound(nodes.begin(), nodes.end(), node {hash(host), 0});
+         return (nodes.end() == it) ? nodes.front().second : it->second;
+      }
+
+   private:
+      using node = std::pair<uint64_t, unsigned>;
+      std::vector<node> nodes;
+
+      // FNV-1a, followed by a finalizer. FNV alone spreads poorly on keys which differ in the last
+      // characters only, like addresses from the same subnet.
+      static uint64_t hash(const std::string &key)
+      {
+         uint64_t h {0xcbf29ce484222325ull};
+         for (unsigned char ch : key) { h ^= ch; h *= 0x100000001b3ull; }
+
+         h ^= h >> 33; h *= 0xff51afd7ed558ccdull;
+         h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ull;
+         return h ^ (h >> 33);
+      }
+};
+
+#endif
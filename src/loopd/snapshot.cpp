@@ -0,0 +1,246 @@
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "aux_log.h"
+#include "snapshot.h"
+
+namespace {
+   const char magic[8] {'L', 'O', 'O', 'P', 'S', 'N', 'A', 'P'};
+   const uint32_t version {1};
+
+   // Interface with empty strings and no samples: id, name, alias, alarm, counter, three averages, samples count.
+   const size_t min_intsize {4 + 4 + 4 + 1 + 8 + 3 * 8 + 4};
+
+   // Builds snapshot image in memory, file is written separately (see write_snapshot).
+   class snapshot_writer
+   {
+      public:
+         snapshot_writer(std::string &image_) : image(image_) { }
+
+         snapshot_writer(const snapshot_writer &other) = delete;
+         snapshot_writer & operator =(const snapshot_writer &other) = delete;
+
+         void put(const void *data, size_t size) { image.append(static_cast<const char *>(data), size); }
+
+         template <typename T>
+         void put(const T &value) { put(&value, sizeof(T)); }
+
+         void put(const std::string &value)
+         {
+            put(static_cast<uint32_t>(value.size()));
+            put(value.data(), value.size());
+         }
+
+      private:
+         std::string &image;
+   };
+
+   // Reads straight from the mapped file. Every read is checked against the end of file.
+   class snapshot_reader
+   {
+      public:
+         snapshot_reader(const char *data, size_t size) : pos{data}, end{data + size} { }
+
+         void get(void *data, size_t size)
+         {
+            static const char *funcname {"snapshot_reader::get"};
+            if (static_cast<size_t>(end - pos) < size) throw logging::error {funcname, "snapshot is truncated"};
+            memcpy(data, pos, size);
+            pos += size;
+         }
+
+         template <typename T>
+         T get() { T value; get(&value, sizeof(T)); return value; }
+
+         size_t remaining() const { return end - pos; }
+
+         // Counts come from the file, so they are checked against its size before anything is allocated.
+         // Item size is the smallest possible size of a single item.
+         uint64_t get_count(size_t itemsize)
+         {
+            static const char *funcname {"snapshot_reader::get_count"};
+            uint64_t count {get<uint32_t>()};
+            if (count > remaining() / itemsize) throw logging::error {funcname, "snapshot is corrupted: bad item count"};
+            return count;
+         }
+
+         std::string get_string()
+         {
+            static const char *funcname {"snapshot_reader::get_string"};
+            uint32_t size {get<uint32_t>()};
+            if (static_cast<size_t>(end - pos) < size) throw logging::error {funcname, "snapshot is truncated"};
+
+            std::string value {pos, size};
+            pos += size;
+            return value;
+         }
+
+      private:
+         const char *pos;
+         const char *end;
+   };
+
+   void load_devices(devsdata &devices, snapshot_reader &reader, unsigned step, int mavsize)
+   {
+      static const char *funcname {"load_snapshot"};
+
+      char filemagic[sizeof(magic)];
+      reader.get(filemagic, sizeof(filemagic));
+      if (0 != memcmp(magic, filemagic, sizeof(magic)) or version != reader.get<uint32_t>())
+         throw logging::error {funcname, "unknown snapshot format"};
+
+      std::vector<oid> objid;
+
+      for (uint64_t ndevs = reader.get<uint64_t>(); 0 != ndevs; ndevs--)
+      {
+         std::string host {reader.get_string()};
+         std::string name {reader.get_string()};
+         std::string community {reader.get_string()};
+         std::string devpath {reader.get_string()};
+
+         device &dev = devices.emplace(std::piecewise_construct, std::forward_as_tuple(host),
+               std::forward_as_tuple(host, name, community, devpath)).first->second;
+
+         dev.objid = reader.get_string();
+         objid.resize(reader.get_count(sizeof(uint64_t)));
+         for (auto &it : objid) it = reader.get<uint64_t>();
+         dev.objid_raw = snmp::oid_handle {objid.data(), objid.size()};
+         dev.timeticks = reader.get<int64_t>();
+         dev.state = hoststate::enabled;
+
+         for (uint64_t nints = reader.get_count(min_intsize); 0 != nints; nints--)
+         {
+            unsigned id {reader.get<uint32_t>()};
+            int_info &intf = dev.ints[id];
+
+            intf.id = id;
+            intf.name = reader.get_string();
+            intf.alias = reader.get_string();
+
+            polldata &data = intf.data;
+            data.alarm = static_cast<alarmtype>(reader.get<uint8_t>());
+            data.counter = reader.get<uint64_t>();
+            data.lastval = reader.get<double>();
+            data.lastmav = reader.get<double>();
+            data.prevmav = reader.get<double>();
+            for (uint64_t nvals = reader.get_count(sizeof(double)); 0 != nvals; nvals--)
+               data.mav_vals.push(reader.get<double>(), mavsize);
+
+            intf.rrdata.init(dev.rrdpath, id, step);
+         }
+      }
+   }
+}
+
+std::string make_snapshot(const devsdata &devices)
+{
+   std::string image;
+
+   // Devices held by worker are skipped, worker may change their interfaces while we're writing.
+   // References are taken by main thread and its poller callbacks only, so a device can't be handed
+   // over while it's being written.
+   auto saved = [](const device &dev) { return hoststate::enabled == dev.state and !dev.dropped and 0 == dev.worker_refs; };
+
+   uint64_t ndevs {};
+   for (auto &it : devices) if (saved(it.second)) ndevs++;
+
+   snapshot_writer writer {image};
+   writer.put(magic, sizeof(magic));
+   writer.put(version);
+   writer.put(ndevs);
+
+   for (auto &it : devices)
+   {
+      const device &dev = it.second;
+      if (!saved(dev)) continue;
+
+      writer.put(dev.host);
+      writer.put(dev.name);
+      writer.put(dev.community);
+      writer.put(dev.rrdpath);
+      writer.put(dev.objid);
+      writer.put(static_cast<uint32_t>(dev.objid_raw.size()));
+      for (size_t i = 0; i < dev.objid_raw.size(); i++) writer.put(static_cast<uint64_t>(dev.objid_raw.data()[i]));
+      writer.put(static_cast<int64_t>(dev.timeticks));
+
+      writer.put(static_cast<uint32_t>(dev.ints.size()));
+      for (auto &intit : dev.ints)
+      {
+         const int_info &intf = intit.second;
+         writer.put(static_cast<uint32_t>(intf.id));
+         writer.put(intf.name);
+         writer.put(intf.alias);
+
+         const polldata &data = intf.data;
+         writer.put(static_cast<uint8_t>(data.alarm));
+         writer.put(static_cast<uint64_t>(data.counter));
+         writer.put(data.lastval);
+         writer.put(data.lastmav);
+         writer.put(data.prevmav);
+
+         std::vector<double> samples {data.mav_vals.samples()};
+         writer.put(static_cast<uint32_t>(samples.size()));
+         writer.put(samples.data(), samples.size() * sizeof(double));
+      }
+   }
+
+   return image;
+}
+
+void write_snapshot(const std::string &image, const std::string &path)
+{
+   static const char *funcname {"write_snapshot"};
+   std::string temppath {path + ".tmp"};
+
+   FILE *fp = fopen(temppath.c_str(), "wb");
+   if (nullptr == fp) throw logging::error {funcname, "failed to open '%s': %s", temppath.c_str(), strerror(errno)};
+
+   bool written {image.size() == fwrite(image.data(), 1, image.size(), fp)};
+   int result = fflush(fp) | fsync(fileno(fp)) | fclose(fp);
+   if (!written or 0 != result)
+      throw logging::error {funcname, "failed to write '%s': %s", temppath.c_str(), strerror(errno)};
+
+   if (-1 == rename(temppath.c_str(), path.c_str()))
+      throw logging::error {funcname, "failed to rename '%s': %s", temppath.c_str(), strerror(errno)};
+}
+
+size_t load_snapshot(devsdata &devices, const std::string &path, unsigned step, int mavsize)
+{
+   static const char *funcname {"load_snapshot"};
+   struct stat stbuf;
+
+   int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+   if (-1 == fd)
+   {
+      if (ENOENT == errno) return 0;
+      throw logging::error {funcname, "failed to open '%s': %s", path.c_str(), strerror(errno)};
+   }
+
+   if (-1 == fstat(fd, &stbuf) or 0 == stbuf.st_size)
+   {
+      close(fd);
+      throw logging::error {funcname, "snapshot '%s' is empty or unreadable", path.c_str()};
+   }
+
+   void *data = mmap(nullptr, stbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (MAP_FAILED == data) throw logging::error {funcname, "failed to map '%s': %s", path.c_str(), strerror(errno)};
+
+   snapshot_reader reader {static_cast<const char *>(data), static_cast<size_t>(stbuf.st_size)};
+
+   try { load_devices(devices, reader, step, mavsize); }
+   catch (...) {
+      munmap(data, stbuf.st_size);
+      devices.clear();
+      throw;
+   }
+
+   munmap(data, stbuf.st_size);
+   return devices.size();
+}
@@ -0,0 +1,24 @@
+#ifndef LOOPD_SNAPSHOT_H
+#define LOOPD_SNAPSHOT_H
+
+#include <string>
+
+#include "device.h"
+
+// Binary snapshot of polled devices: identity, type, interfaces and their polling history
+// (counters, moving average window, alarm state). Loaded at startup, so polling and detection
+// continue from where they were instead of waiting for device update and an hour of samples.
+// Only enabled devices which are not held by worker are saved, the rest are left to the regular device update.
+
+// Image is built in memory from main thread between polls. Writing it is slow because of fsync,
+// so it's done separately and may be called from any thread.
+std::string make_snapshot(const devsdata &devices);
+
+// Written to a temporary file and renamed over the old snapshot, so a crash never leaves a broken one.
+void write_snapshot(const std::string &image, const std::string &path);
+
+// Loaded devices are in enabled state with their RRD sets initialized. Missing file is not an error.
+// Returns number of loaded devices.
+size_t load_snapshot(devsdata &devices, const std::string &path, unsigned step, int mavsize);
+
+#endif
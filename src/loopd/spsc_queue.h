@@ -0,0 +1,63 @@
+#ifndef LOOPD_SPSCQUEUE_H
+#define LOOPD_SPSCQUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+// Bounded lock-free ring for a single producer and a single consumer. Neither side ever blocks:
+// push fails when the ring is full, pop fails when it's empty.
+template <typename T>
+class spsc_queue
+{
+   public:
+      // Capacity is rounded up to a power of two.
+      explicit spsc_queue(size_t capacity) : slots(round_up(capacity)), mask{slots.size() - 1} { }
+
+      spsc_queue(const spsc_queue &other) = delete;
+      spsc_queue & operator =(const spsc_queue &other) = delete;
+
+      bool push(const T &value)
+      {
+         size_t tail = tail_.load(std::memory_order_relaxed);
+         if (slots.size() == tail - head_.load(std::memory_order_acquire)) return false;
+
+         slots[tail & mask] = value;
+         tail_.store(tail + 1, std::memory_order_release);
+         return true;
+      }
+
+      bool pop(T &value)
+      {
+         size_t head = head_.load(std::memory_order_relaxed);
+         if (head == tail_.load(std::memory_order_acquire)) return false;
+
+         value = slots[head & mask];
+         head_.store(head + 1, std::memory_order_release);
+         return true;
+      }
+
+      // Approximate when called while the other side is running.
+      size_t size() const
+      {
+         size_t head = head_.load(std::memory_order_acquire);
+         return tail_.load(std::memory_order_acquire) - head;
+      }
+
+   private:
+      std::vector<T> slots;
+      size_t mask;
+
+      // Each index is written by one side only, so they are kept in separate cache lines.
+      alignas(64) std::atomic<size_t> head_ {0};
+      alignas(64) std::atomic<size_t> tail_ {0};
+
+      static size_t round_up(size_t capacity)
+      {
+         size_t size {1};
+         while (size < capacity) size <<= 1;
+         return size;
+      }
+};
+
+#endif
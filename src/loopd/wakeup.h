@@ -0,0 +1,51 @@
+#ifndef LOOPD_WAKEUP_H
+#define LOOPD_WAKEUP_H
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "aux_log.h"
+
+// Wakeup signal built on eventfd. Notifications sent while nobody waits are not lost,
+// the next wait() returns at once.
+class wakeup
+{
+   public:
+      wakeup()
+      {
+         static const char *funcname {"wakeup::wakeup"};
+         if (-1 == (fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)))
+            throw logging::error {funcname, "eventfd() failed: %s", strerror(errno)};
+      }
+
+      ~wakeup() { close(fd); }
+
+      wakeup(const wakeup &other) = delete;
+      wakeup & operator =(const wakeup &other) = delete;
+
+      void notify()
+      {
+         uint64_t one {1};
+         // Can only fail if counter overflows, but then the waiter is going to wake up anyway.
+         if (-1 == write(fd, &one, sizeof(one))) return;
+      }
+
+      // Timeout is in milliseconds, negative value waits forever. Pending notifications are consumed.
+      void wait(int timeout)
+      {
+         pollfd pfd {fd, POLLIN, 0};
+         uint64_t count;
+
+         if (0 < poll(&pfd, 1, timeout) and -1 == read(fd, &count, sizeof(count))) return;
+      }
+
+   private:
+      int fd;
+};
+
+#endif
@@ -1,11 +1,14 @@
 #include <cstdio>
-#include <fcntl.h>
 #include <curl/curl.h>
 
-#include <openssl/bio.h>
 #include <openssl/evp.h>
 
-#include <list>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <unordered_map>
 
 #include "snmp/oids.h"
 
@@ -13,59 +16,144 @@
 #include "worker.h"
 #include "data.h"
 
-unsigned long check_bc_rate(const device *dev, unsigned intnum)
+namespace {
+   // Recheck of a single device. All alarmed interfaces of the device are asked in one request.
+   struct recheck
+   {
+      device *dev;
+      std::vector<size_t> alarms;         // Positions in the alarm list, in varbinds order.
+      std::vector<uint64_t> counters[2];  // Answers for both rounds.
+      std::chrono::steady_clock::time_point received[2];
+      unsigned round {};
+      bool failed {false};
+   };
+
+   int recheck_callback(int operation, snmp_session *, int, netsnmp_pdu *pdu, void *magic, void *)
+   {
+      static const char *funcname {"recheck_callback"};
+      recheck &rc = *static_cast<recheck *>(magic);
+
+      if (NETSNMP_CALLBACK_OP_RECEIVED_MESSAGE != operation or SNMP_ERR_NOERROR != pdu->errstat)
+      {
+         rc.failed = true;
+         return snmp::ok_close;
+      }
+
+      for (netsnmp_variable_list *vars = pdu->variables; vars; vars = vars->next_variable)
+      {
+         if (ASN_COUNTER64 != vars->type)
+         {
+            logger.log_message(LOG_ERR, funcname, "%s: Unexpected ASN type in asnwer", rc.dev->host.c_str());
+            rc.failed = true;
+            break;
+         }
+
+         rc.counters[rc.round].push_back(vars->val.counter64->high << 32 | vars->val.counter64->low);
+      }
+
+      rc.received[rc.round] = std::chrono::steady_clock::now();
+      return snmp::ok_close;
+   }
+}
+
+// Rechecks broadcast rate on every alarmed interface at once. Devices are polled concurrently, each one gets
+// a single request per round and there is only one sleep between the rounds. A round takes as long as its
+// slowest device, so every device's rate is taken over the time between its own two answers, not over the
+// sleep. Rate is 0 when device has not answered, so the alarm is sent anyway.
+std::vector<unsigned long> recheck_rates(const std::vector<alarm_info> &alarms)
 {
-   static const char *funcname {"check_bc_rate"};
    static const std::chrono::seconds interval {config["poller"]["recheck-interval"].get<conf::integer_t>()};
+   static const unsigned max_hosts {static_cast<unsigned>(config["snmp"]["max-hosts"].get<conf::integer_t>())};
+   // Main poller's sessions and storage files are already open, recheck sockets can't rely on select().
+   static const snmp::poll_method method {configured_poll_method()};
 
-   netsnmp_pdu *req;
-   snmp::pdu_handle response;
-   uint64_t counter {}, delta {};
+   std::unordered_map<device *, recheck> checks;
+   for (size_t i = 0; i < alarms.size(); i++)
+   {
+      recheck &rc = checks[alarms[i].dev];
+      rc.dev = alarms[i].dev;
+      rc.alarms.push_back(i);
+   }
 
-   snmp::sess_handle sessp {snmp::init_snmp_session(dev->host.c_str(), dev->community.c_str())};   
-   for (unsigned i = 0; i < 2; i++)
+   snmp::mux_poller rechecker {max_hosts, method};
+   for (auto &it : checks)
    {
-      req = snmp_pdu_create(SNMP_MSG_GET);
-      snmp_add_null_var(req, snmp::oids::ifbroadcast, snmp::oids::ifbroadcast_size);
-      req->variables->name[snmp::oids::ifbroadcast_size - 1] = intnum;
+      recheck &rc = it.second;
+      netsnmp_pdu *req = snmp_pdu_create(SNMP_MSG_GET);
 
-      try { response = snmp::synch_request(sessp, req); }
-      catch (snmp::snmprun_error &error)
+      for (auto n : rc.alarms)
       {
-         if (snmp::errtype::timeout == error.type) return 0;
-         else throw;
+         netsnmp_variable_list *var = snmp_add_null_var(req, snmp::oids::ifbroadcast, snmp::oids::ifbroadcast_size);
+         var->name[snmp::oids::ifbroadcast_size - 1] = alarms[n].intf->id;
       }
 
-      if (ASN_COUNTER64 != response.pdu->variables->type)
-         throw logging::error {funcname, "%s: Unexpected ASN type in asnwer", dev->host.c_str()};
+      // Poller keeps its own copy of the request.
+      rechecker.add(rc.dev->host.c_str(), rc.dev->community.c_str(), req, recheck_callback, &rc);
+      snmp_free_pdu(req);
+   }
+
+   rechecker.poll();
+   for (auto &it : checks) it.second.round = 1;
+   std::this_thread::sleep_for(interval);
+   rechecker.poll();
+
+   std::vector<unsigned long> rates(alarms.size());
+   for (auto &it : checks)
+   {
+      recheck &rc = it.second;
+      if (rc.failed or rc.alarms.size() != rc.counters[0].size() or rc.alarms.size() != rc.counters[1].size())
+         continue;
+
+      std::chrono::duration<double> window {rc.received[1] - rc.received[0]};
+      if (0 >= window.count()) continue;
 
-      counter = response.pdu->variables->val.counter64->high << 32 | response.pdu->variables->val.counter64->low;
-      if (0 == i) { delta = counter; std::this_thread::sleep_for(interval); }
+      for (size_t i = 0; i < rc.alarms.size(); i++)
+         rates[rc.alarms[i]] = (rc.counters[1][i] - rc.counters[0][i]) / window.count();
    }
 
-   delta = (counter - delta) / interval.count();
-   return (unsigned long) delta;
+   return rates;
 }
 
-FILE * generate_message(alarm_info &data, unsigned long bcrate)
+// Alarms of a single device, they are sent in one message.
+struct digest
 {
-   static const char *funcname {"generate_message"};
-   static const conf::string_t graphfile {config["datadir"].get<conf::string_t>() + "/graph.png"};
+   device *dev;
+   std::vector<size_t> alarms;
+};
 
+void encode_image(FILE *fp, const std::string &png)
+{
+   // 57 bytes of image make a single 76 characters line of base64, as MIME wants it.
+   const size_t chunk {57};
+   unsigned char line[4 * chunk / 3 + 1];
+   const unsigned char *img = reinterpret_cast<const unsigned char *>(png.data());
+
+   for (size_t pos = 0; pos < png.size(); pos += chunk)
+   {
+      int len = EVP_EncodeBlock(line, img + pos, std::min(chunk, png.size() - pos));
+      fprintf(fp, "%.*s\r\n", len, line);
+   }
+}
+
+FILE * generate_message(const digest &dg, const std::vector<alarm_info> &alarms, const std::vector<unsigned long> &rates)
+{
+   static const char *funcname {"generate_message"};
    static const conf::integer_t xsize {config["notifier"]["image-width"].get<conf::integer_t>()};
    static const conf::integer_t ysize {config["notifier"]["image-height"].get<conf::integer_t>()};
    static const conf::string_t &from {config["notifier"]["from"].get<conf::string_t>()};
    static const conf::multistring_t &rcpts {config["notifier"]["rcpts"].get<conf::multistring_t>()};   
 
-   int_info &intf = *(data.intf);
+   const device &dev = *(dg.dev);
+   std::vector<std::shared_ptr<const std::string>> graphs;
    buffer title;
 
-   title.print("%s: %s - %s", data.dev->host.c_str(), intf.name.c_str(), intf.alias.c_str());
-   intf.rrdata.graph(graphfile.c_str(), title.data(), xsize, ysize);
-
-   int fd = open(graphfile.c_str(), O_RDONLY);
-   if (-1 == fd) throw logging::error {funcname, "Failed to open graph file '%s': %s.",
-      graphfile.c_str(), strerror(errno)};
+   // Graphs are rendered first, so a failed render does not leave half-written message.
+   for (auto n : dg.alarms)
+   {
+      int_info &intf = *(alarms[n].intf);
+      title.print("%s: %s - %s", dev.host.c_str(), intf.name.c_str(), intf.alias.c_str());
+      graphs.push_back(intf.rrdata.graph(title.data(), xsize, ysize));
+   }
 
    FILE *fp = tmpfile();
    if (nullptr == fp) throw logging::error {funcname, "Failed to create temporary datafile."};
@@ -73,91 +161,145 @@ FILE * generate_message(alarm_info &data, unsigned long bcrate)
    fprintf(fp, "From: %s\r\n", from.c_str());
    for (const auto &to : rcpts) fprintf(fp, "To: %s\r\n", to.c_str());
 
-   fprintf(fp, "Subject: %s: High broadcast pps level - %s\r\n"
-               "Mime-Version: 1.0\r\n"
+   if (1 == dg.alarms.size())
+      fprintf(fp, "Subject: %s: High broadcast pps level - %s\r\n", dev.host.c_str(), alarms[dg.alarms[0]].intf->name.c_str());
+   else
+      fprintf(fp, "Subject: %s: High broadcast pps level on %lu interfaces\r\n", dev.host.c_str(), dg.alarms.size());
+
+   fprintf(fp, "Mime-Version: 1.0\r\n"
                "Content-Type: multipart/related; boundary=\"bound\"\r\n"
                "\r\n"
                "--bound\r\n"
-               "Content-Type: text/html; charset=\"UTF-8\"\r\n\r\n",
-           data.dev->host.c_str(), intf.name.c_str());
+               "Content-Type: text/html; charset=\"UTF-8\"\r\n\r\n");
 
-   fprintf(fp, "High broadcast pps level detected on device: %s - %s<br>\n"
-               "Interface: %s - %s<br>\n"
-               "Alarm type: <b>%s</b><br>\n",
-           data.dev->host.c_str(), data.dev->name.c_str(), intf.name.c_str(),
-           intf.alias.c_str(), alarmtype_names[intf.data.alarm].c_str());
+   fprintf(fp, "High broadcast pps level detected on device: %s - %s<br>\n<br>\n",
+           dev.host.c_str(), dev.name.c_str());
 
-   if (alarmtype::spike == intf.data.alarm)
-      fprintf(fp, "Broadcast pps measured in last 2 seconds: %lu<br>\n", bcrate);
-   fprintf(fp, "<br>\n");
-
-   fprintf(fp, "<IMG SRC=\"cid:graph.png\" ALT=\"Graph\">\r\n"
-               "--bound\r\n"
-               "Content-Location: CID:somelocation\n"
-               "Content-ID: <graph.png>\n"
-               "Content-Type: IMAGE/PNG\n"
-               "Content-Transfer-Encoding: BASE64\n\n");   
-
-   BIO *b64 = BIO_new(BIO_f_base64());
-   BIO *bio = BIO_new_fp(fp, BIO_NOCLOSE);
-   BIO_push(b64, bio);
-
-   int rval;
-   const size_t bufsize = 512;
-   char imgbuf[bufsize];
+   for (size_t i = 0; i < dg.alarms.size(); i++)
+   {
+      const int_info &intf = *(alarms[dg.alarms[i]].intf);
+      fprintf(fp, "Interface: %s - %s<br>\n"
+                  "Alarm type: <b>%s</b><br>\n",
+              intf.name.c_str(), intf.alias.c_str(), alarmtype_names[intf.data.alarm].c_str());
+
+      if (alarmtype::spike == intf.data.alarm)
+         fprintf(fp, "Broadcast pps measured in last 2 seconds: %lu<br>\n", rates[dg.alarms[i]]);
+      fprintf(fp, "<br>\n<IMG SRC=\"cid:graph%lu.png\" ALT=\"Graph\"><br>\n<br>\n", i);
+   }
 
-   while (0 < (rval = read(fd, imgbuf, bufsize))) BIO_write(b64, imgbuf, rval);
-   (void) BIO_flush(b64);
-   BIO_free_all(b64);
-   close(fd);
+   for (size_t i = 0; i < graphs.size(); i++)
+   {
+      fprintf(fp, "\r\n--bound\r\n"
+                  "Content-Location: CID:somelocation\n"
+                  "Content-ID: <graph%lu.png>\n"
+                  "Content-Type: IMAGE/PNG\n"
+                  "Content-Transfer-Encoding: BASE64\n\n", i);
+      encode_image(fp, *graphs[i]);
+   }
 
+   fprintf(fp, "--bound--\r\n");
    return fp;
 }
 
-void send_message(FILE *data)
+// Handle is reused for all messages of a sender, so libcurl keeps SMTP connection open between them.
+void send_message(CURL *curl, curl_slist *recipients, FILE *data)
 {
    static const char *funcname {"send_message"};
    static const conf::string_t &from {config["notifier"]["from"].get<conf::string_t>()};
-   static const conf::multistring_t &rcpts {config["notifier"]["rcpts"].get<conf::multistring_t>()};
    static const conf::string_t &smtphost {config["notifier"]["smtphost"].get<conf::string_t>()};
 
-   CURL *curl = curl_easy_init();
-   if (nullptr == curl) throw logging::error {funcname, "curl_easy_init failed."};
-
    curl_easy_setopt(curl, CURLOPT_URL, smtphost.c_str());
    curl_easy_setopt(curl, CURLOPT_MAIL_FROM, from.c_str());
-
-   curl_slist *recipients {};
-   for (const auto &to : rcpts) recipients = curl_slist_append(recipients, to.c_str());
    curl_easy_setopt(curl, CURLOPT_MAIL_RCPT, recipients);
 
    rewind(data);
    curl_easy_setopt(curl, CURLOPT_READDATA, data);
+   curl_easy_setopt(curl, CURLOPT_UPLOAD, 1L);
 
    CURLcode res = curl_easy_perform(curl);
    if (CURLE_OK != res) throw logging::error {funcname, "curl_easy_perform() failed: %s",
       curl_easy_strerror(res)};
+}
 
-   curl_slist_free_all(recipients);
-   curl_easy_cleanup(curl);
+// Alarms are grouped by device, every device gets a single message with a graph for each interface.
+// Messages are prepared and sent by a bounded pool of threads, each sender keeps its own SMTP connection.
+void send_alarms(std::vector<alarm_info> &alarms, const std::vector<unsigned long> &rates)
+{
+   static const char *funcname {"send_alarms"};
+   static const size_t nthreads {static_cast<size_t>(config["notifier"]["notify-threads"].get<conf::integer_t>())};
+   static const conf::multistring_t &rcpts {config["notifier"]["rcpts"].get<conf::multistring_t>()};
+
+   if (alarms.empty()) return;
+
+   std::vector<digest> digests;
+   std::unordered_map<device *, size_t> bydev;
+
+   for (size_t i = 0; i < alarms.size(); i++)
+   {
+      auto it = bydev.emplace(alarms[i].dev, digests.size());
+      if (it.second) digests.push_back(digest {alarms[i].dev, {}});
+      digests[it.first->second].alarms.push_back(i);
+   }
+
+   std::atomic<size_t> next {0};
+   auto sender = [&]() {
+      std::unique_ptr<CURL, void (*)(CURL *)> curl {curl_easy_init(), curl_easy_cleanup};
+      if (nullptr == curl)
+      {
+         logger.log_message(LOG_ERR, funcname, "curl_easy_init failed.");
+         return;
+      }
+
+      curl_slist *rlist {};
+      for (const auto &to : rcpts) rlist = curl_slist_append(rlist, to.c_str());
+      std::unique_ptr<curl_slist, void (*)(curl_slist *)> recipients {rlist, curl_slist_free_all};
+
+      for (size_t i; (i = next++) < digests.size();)
+      {
+         try {
+            std::unique_ptr<FILE, int (*)(FILE *)> message {generate_message(digests[i], alarms, rates), fclose};
+            send_message(curl.get(), recipients.get(), message.get());
+         }
+
+         catch (std::exception &exc) {
+            logger.log_message(LOG_ERR, funcname, "%s: failed to send alarms for %lu interfaces: %s",
+                  digests[i].dev->host.c_str(), digests[i].alarms.size(), exc.what());
+         }
+      }
+   };
+
+   logger.log_message(LOG_INFO, funcname, "sending %lu alarms in %lu messages", alarms.size(), digests.size());
+
+   std::vector<std::thread> pool;
+   for (size_t i = 1; i < std::min(nthreads, digests.size()); i++) pool.emplace_back(sender);
+   sender();
+   for (auto &it : pool) it.join();
 }
 
-void process_alarms(std::unique_lock<std::mutex> &datalock)
+void process_alarms(thread_sync *syncdata)
 {
    static const char *funcname {"process_alarms"};
    static const double bcmax_c  {config["poller"]["bcmax"].get<conf::integer_t>() * 0.8};
    static const double mavmax_c {config["poller"]["mavmax"].get<conf::integer_t>() * 0.8};
 
-   unsigned long bcrate {};
+   std::vector<alarm_info> pending, confirmed;
+   std::vector<unsigned long> rates, sendrates;
    double calc {};
 
-   for (alarm_info data; !alarm_data.empty();)
-   {
-      data = alarm_data.back();
-      alarm_data.pop_back();
-      datalock.unlock();
+   for (alarm_info data; syncdata->alarms.pop(data);) pending.push_back(data);
+   if (pending.empty()) return;
+
+   // Alarms of devices removed by the last update are released without rechecks.
+   std::vector<alarm_info>::iterator live = std::stable_partition(pending.begin(), pending.end(),
+         [](const alarm_info &data) { return !data.dev->dropped; });
+   for (auto it = live; it != pending.end(); ++it) it->dev->worker_refs--;
+   pending.erase(live, pending.end());
+   if (pending.empty()) return;
 
-      bcrate = check_bc_rate(data.dev, data.intf->id);
+   rates = recheck_rates(pending);
+   for (size_t i = 0; i < pending.size(); i++)
+   {
+      alarm_info &data = pending[i];
       switch (data.intf->data.alarm)
       {
          case alarmtype::spike:  calc = data.intf->data.lastmav * data.intf->data.mav_vals.size() * 0.5; break;
@@ -166,22 +308,22 @@ void process_alarms(std::unique_lock<std::mutex> &datalock)
          default: throw logging::error {funcname, "%s: unexpected alarm type", data.dev->host.c_str()};
       }
 
-      if (0 != bcrate and bcrate < calc)
+      if (0 != rates[i] and rates[i] < calc)
       {
             logger.log_message(LOG_INFO, funcname, "%s: alarm has not been sent. Rechecked broadcast rate: %lu. "
-                  "Calculated: %02.f", data.dev->host.c_str(), bcrate, calc);
-            datalock.lock();
+                  "Calculated: %02.f", data.dev->host.c_str(), rates[i], calc);
             continue;
       }
 
-      FILE *message = generate_message(data, bcrate);
-      send_message(message);
-      fclose(message);
-      datalock.lock();
+      confirmed.push_back(data);
+      sendrates.push_back(rates[i]);
    }
+
+   send_alarms(confirmed, sendrates);
+   for (auto &it : pending) it.dev->worker_refs--;
 }
 
-void return_dev(device &dev)
+void return_dev(device &dev, thread_sync *syncdata)
 {
    std::vector<unsigned> intdel;
 
@@ -196,34 +338,56 @@ void return_dev(device &dev)
    dev.reset();
    
    prepare_request(dev);
-   return_data.push_back(&dev);
+
+   // Ring is drained by main thread after every slot, so it's full only for a moment. Worker may wait here
+   // until main thread takes some devices, main thread never waits for worker.
+   while (!syncdata->returns.push(&dev)) syncdata->returns_drained.wait(-1);
 }
 
-void process_devices(std::unique_lock<std::mutex> &datalock, std::list<device *> &polldevs, thread_sync *syncdata)
+// Unreachable devices by the time of their next try. Worker sleeps until the first one is due.
+using retry_schedule = std::multimap<time_t, device *>;
+
+// Drops devices removed by main thread, so they don't wait for their backoff to expire.
+void purge_dropped(retry_schedule &retries)
+{
+   for (retry_schedule::iterator it = retries.begin(); it != retries.end();)
+   {
+      if (!it->second->dropped) { ++it; continue; }
+      it->second->worker_refs--;
+      it = retries.erase(it);
+   }
+}
+
+void process_devices(retry_schedule &retries, thread_sync *syncdata)
 {
    static const char *funcname {"process_devices"};
    static const unsigned retry_interval {10};
    static const unsigned max_backoff {1024};
+   // Devices which have ever answered are most likely to come back soon, so they are retried more often.
+   static const unsigned known_backoff {64};
 
-   if (!action_data.empty())
+   for (device *dev; syncdata->actions.pop(dev);)
    {
-      for (auto &it : action_data)
-      {
-         it->timeticks = 0;
-         polldevs.push_back(it);
-         logger.log_message(LOG_INFO, funcname, "%s: new device task added.", it->host.c_str());
-      }
-
-      action_data.clear();
+      dev->timeticks = 0;
+      retries.emplace(0, dev);
+      logger.log_message(LOG_INFO, funcname, "%s: new device task added.", dev->host.c_str());
    }
 
-   datalock.unlock();
+   if (syncdata->purge.exchange(false)) purge_dropped(retries);
+
+   std::vector<device *> due;
    time_t rawtime {time(nullptr)};
 
-   for (auto it : polldevs)
+   for (retry_schedule::iterator it = retries.begin(); retries.end() != it and it->first <= rawtime;)
+   {
+      due.push_back(it->second);
+      it = retries.erase(it);
+   }
+
+   for (auto it : due)
    {
       device &dev = *it;
-      if (rawtime < dev.timeticks) continue;
+      if (dev.dropped) { dev.worker_refs--; continue; }
 
       init_device(dev);
       if (hoststate::enabled == dev.state) update_ints(dev);
@@ -231,62 +395,43 @@ void process_devices(std::unique_lock<std::mutex> &datalock, std::list<device *>
       // Checking again in case we failed while interfaces update.
       if (hoststate::enabled != dev.state)
       {
+         dev.rtt.failure();
          dev.timeticks = ((0 == dev.timeticks) ? time(nullptr) : dev.timeticks) + retry_interval * dev.wait_backoff;
-         if (dev.wait_backoff < max_backoff) dev.wait_backoff *= 2;
+         if (dev.wait_backoff < ((0 == dev.rtt.samples) ? max_backoff : known_backoff)) dev.wait_backoff *= 2;
 
          logger.log_message(LOG_INFO, funcname, "%s: device is still unreachable. Increasing backoff to %u",
                dev.host.c_str(), dev.wait_backoff);
+         retries.emplace(dev.timeticks, &dev);
          continue;
       }
 
+      // Reference is passed along with the device and released by main thread once it takes the device
+      // from the ring. Worker must not touch the device after that.
       logger.log_message(LOG_INFO, funcname, "%s: device is active. Passing back to the main thread.", dev.host.c_str());
-      syncdata->updatelock.lock();
-
-      return_dev(dev);
-      syncdata->data_updated = true;
-      syncdata->updatelock.unlock();
+      return_dev(dev, syncdata);
    }
-
-   polldevs.remove_if([](device *dev) { return dev->state == hoststate::enabled; });
-   datalock.lock();
 }
 
 void workloop(thread_sync *syncdata)
 {
    static const char *funcname {"workloop"};
-   static const std::chrono::seconds interval {2};
-
-   std::list<device *> polldevs;
-   std::unique_lock<std::mutex> datalock {syncdata->worker_datalock};
-   std::unique_lock<std::mutex> statelock {syncdata->statelock, std::defer_lock};
+   retry_schedule retries;
+   int timeout;
 
    for (;;)
    {
-      if (action_data.empty() and alarm_data.empty())
-      {
-         datalock.unlock();
-
-         if (polldevs.empty())
-         {
-            statelock.lock();
-            logger.log_message(LOG_INFO, funcname, "No jobs available - waiting on condition variable.");
-
-            syncdata->sleeping = true;
-            while (syncdata->sleeping) syncdata->wake.wait(statelock);
-            statelock.unlock();
-         }
+      process_alarms(syncdata);
+      process_devices(retries, syncdata);
 
-         else std::this_thread::sleep_for(interval);
-         datalock.lock();
+      // Sleeping until the next retry is due or main thread hands over new jobs.
+      if (retries.empty())
+      {
+         logger.log_message(LOG_INFO, funcname, "No jobs available - waiting for wakeup.");
+         timeout = -1;
       }
 
-      if (!alarm_data.empty()) process_alarms(datalock);
-
-      statelock.lock();
-      if (!syncdata->running) return;
-      statelock.unlock();
-
-      process_devices(datalock, polldevs, syncdata);
+      else timeout = std::max<time_t>(0, retries.begin()->first - time(nullptr)) * 1000;
+      syncdata->wake.wait(timeout);
    }
 }
 
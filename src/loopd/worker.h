@@ -1,25 +1,35 @@
 #ifndef LOOPD_WORKER_H
 #define LOOPD_WORKER_H
 
-#include <mutex>
+#include <atomic>
 #include <thread>
 #include <vector>
-#include <condition_variable>
 
 #include "prog_config.h"
+#include "data.h"
+#include "spsc_queue.h"
+#include "wakeup.h"
 
+// Main thread and worker exchange jobs through single producer/consumer rings only, neither of them
+// waits for the other. Jobs which don't fit into a full ring are kept by main thread for the next round.
+// Device data is owned by main thread, except devices held by worker (see device::worker_refs), so there
+// is no lock around it.
 struct thread_sync
 {
-   std::mutex device_datalock;
-   std::mutex worker_datalock;
+   static const size_t queue_size {4096};
 
-   std::mutex statelock;
-   bool sleeping {true};
-   bool running {true};
-   std::condition_variable wake;
+   // Main thread -> worker.
+   spsc_queue<device *> actions {queue_size};
+   spsc_queue<alarm_info> alarms {queue_size};
+   wakeup wake;
 
-   std::mutex updatelock;
-   bool data_updated {false};
+   // Worker -> main thread: devices which are active again. Each one still holds worker's reference,
+   // main thread releases it when the device is taken from the ring.
+   spsc_queue<device *> returns {queue_size};
+   wakeup returns_drained;    // Main thread took some devices, worker waits on it when the ring is full.
+
+   // Set by main thread when some devices were dropped, worker releases them without waiting for their retry.
+   std::atomic<bool> purge {false};
 };
 
 void worker(thread_sync *);